@@ -1,12 +1,46 @@
 
 // terminal_weather.c
 // Rain + lightning animation for TTY using ncurses (Arch Linux friendly)
-// Controls: 't' toggle thunderstorm, 'q' or ESC to quit
-// Build: gcc -O2 -Wall -Wextra terminal_weather.c -lncurses -o terminal_weather
+// Controls: 't' toggle thunderstorm, 'f' toggle stats overlay, 'q' or ESC to quit
+// Output: --backend curses (default) or ansi (own diffing, one write() per frame)
+// Options: --damage redraws only changed cells instead of erase() every frame
+//          --seed S fixes the random streams, --thunder starts with the storm on
+//          --virtual-clock advances time by exactly one frame interval per frame
+//          --fps N caps the frame rate (slower when idle or the tty backs up)
+//          --stats-file PATH appends one CSV line of frame statistics per frame
+//          --threads N splits rain into N column bands on a worker pool
+//          --density F scales how many drops spawn per step
+//          --render-thread writes to the terminal from a separate thread
+//          --frame-budget-ms MS thins rain and bolts while frames cost more than MS
+//          --rain-engine columns keeps drops in per-column rings (wide screens)
+//          --max-memory SIZE preallocates everything and drops rain past it
+//          --max-bolts N allows N bolts at once; strikes come more often to match
+//          --flash reverses the screen on each strike and lights up the sky
+//          --colors 256|truecolor shades rain by speed and fades lightning
+//          through a color gradient (default 8: the plain named colors)
+//          --panes N shows N independent skies side by side in one process
+//          --max-bytes-per-sec N keeps output under N bytes/s (serial consoles,
+//          slow SSH) by skipping frames, then dim drops, then rows in rotation
+//          --low-power draws only as often as the slowest drop moves and stops
+//          while the terminal is unfocused; SIGUSR1 pauses, SIGUSR2 resumes
+// Benchmark: --bench N [--size COLSxROWS] [--seed S] [--thunder] [--backend B]
+//                    [--threads N] [--density F] [--rain-engine vector|columns]
+//                    [--max-memory SIZE] [--max-bolts N] [--colors 8|256|truecolor] [--panes N]
+//            (no TTY needed; with --backend, frames are also presented to /dev/null)
+//            --microbench [--size COLSxROWS] [--seed S] times each hot kernel alone
+// Record: --record FILE logs every frame; --replay FILE [--replay-fast] plays it back
+// Serve: --serve unix:PATH|tcp:[HOST:]PORT [--serve-format ansi|delta] [--size COLSxROWS]
+//        streams one simulation to many clients, e.g. socat - UNIX-CONNECT:PATH
+// Config: --config FILE reads "option = value" lines (any long option, e.g. fps = 30)
+// Build: gcc -O2 -Wall -Wextra -pthread terminal_weather.c -lncurses -o terminal_weather
+//        [-DWEATHER_PROFILE=default|lowpower|dense]  (see weather_profiles.h)
 
+#define _GNU_SOURCE     // ppoll()
 #define _XOPEN_SOURCE 700
 #include <ncurses.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <time.h>
 #include <string.h>
@@ -14,31 +48,83 @@
 #include <unistd.h>
 #include <signal.h>
 #include <getopt.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define RAIN_SIMD_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RAIN_SIMD_NEON 1
+#endif
+
+#include "weather_profiles.h"
 
-#define UPDATE_INTERVAL 0.015  // seconds (approx 66 FPS)
+#define UPDATE_INTERVAL WP_FRAME_INTERVAL // default seconds between rendered frames
+#define SIM_DT 0.015           // fixed simulation timestep (seconds)
+#define MAX_STEPS_PER_FRAME 5  // backlog beyond this is dropped instead of stalling
+#define LOW_POWER_MAX_INTERVAL (MAX_STEPS_PER_FRAME * SIM_DT) // longest --low-power frame
 
 // Colors
 #define CP_RAIN_NORMAL 1
 #define CP_LIGHTNING   4
+#define CP_RAIN_SHADE  8   // --colors 256|truecolor: one pair per rain shade
+#define CP_FADE_STEP   16  // and one per lightning fade step
 
 // Lightning config
-static const char *LIGHTNING_CHARS = "*+#";  // fades '*' -> '+' -> '#'
-static const double LIGHTNING_GROWTH_DELAY = 0.002;
+// A segment fades through FADE_STEPS steps, newest first: '#' -> '+' -> '*',
+// each glyph in two shades when --colors gives lightning a gradient.
+#define FADE_STEPS 6
+static const char FADE_GLYPHS[FADE_STEPS + 1] = "##++**";
+static const double LIGHTNING_GROWTH_DELAY = 0.002; // seconds between growth steps of a bolt
+static const double LIGHTNING_GROWTH_DELAY_LOD = 0.03; // added at the lowest level of detail
 static const int    LIGHTNING_MAX_BRANCHES = 2;
-static const double LIGHTNING_BRANCH_CHANCE = 0.3;
-static const double FORK_CHANCE = 0.15;
+static const double LIGHTNING_BRANCH_CHANCE = WP_LIGHTNING_BRANCH_CHANCE;
+static const double FORK_CHANCE = WP_FORK_CHANCE;
 static const int    FORK_HORIZONTAL_SPREAD = 3;
-static const double SEGMENT_LIFESPAN = 0.8; // seconds to fade out
-static const double LIGHTNING_CHANCE = 0.005;
+static const double SEGMENT_LIFESPAN = WP_SEGMENT_LIFESPAN; // seconds to fade out
+static const double SEGMENT_STEP_AGE[FADE_STEPS - 1] = { 0.165, 0.33, 0.495, 0.66, 0.83 }; // step k until this fraction of it
+static const double LIGHTNING_CHANCE = WP_LIGHTNING_CHANCE;
+static const double FLASH_TIME = 0.05; // seconds the screen stays reversed after a strike (--flash)
+#define MAX_BOLTS WP_MAX_BOLTS // default --max-bolts: concurrent bolts, sizes the segment pool
+#define LOD_MIN 0.1 // lowest level of detail --frame-budget-ms may pick
+
+// Rain config (speeds in rows per second)
+static const double RAIN_MIN_SPEED = 20.0;
+static const double RAIN_MAX_SPEED = 40.0;
+static const double RAIN_MAX_SPEED_STORM = 66.7;
+static const double RAIN_DIM_SPEED = 53.3; // slower drops are drawn A_DIM
+static const double RAIN_CHANCE = WP_RAIN_CHANCE, RAIN_CHANCE_STORM = WP_RAIN_CHANCE_STORM;
+static const int    RAIN_COLS_PER_DROP = WP_RAIN_COLS_PER_DROP;
+static const int    RAIN_COLS_PER_DROP_STORM = WP_RAIN_COLS_PER_DROP_STORM;
+static const char   RAIN_CHARS[] = WP_RAIN_GLYPHS;
+#define RAIN_SHADES 8 // rain colors by speed, with a gradient palette
+_Static_assert(CP_RAIN_SHADE + RAIN_SHADES <= CP_FADE_STEP, "rain shade pairs run into the fade steps");
+#define RAIN_LOOKS (2 * ((int)sizeof(WP_RAIN_GLYPHS) - 1) * RAIN_SHADES) // glyph x {fast, slow} x shade
+#define RAIN_TEMPLATES 256 // spawn templates per weather; a power of two
 
-static int g_rows, g_cols;
 static volatile sig_atomic_t g_resized = 0;
+static volatile sig_atomic_t g_quit = 0;
+static volatile sig_atomic_t g_suspend = 0; // SIGTSTP: leave the terminal, then stop
+static volatile sig_atomic_t g_idle = 0;    // 1: SIGUSR1 (pause), 2: SIGUSR2 (resume)
 
+// A single drop as handed to rain_push(); storage is structure-of-arrays.
 typedef struct {
     int x;
-    double y;
-    double speed;
-    char ch;
+    float y;
+    float speed; // rows per second
+    unsigned char look; // index into Sim.looks: glyph and brightness
 } Raindrop;
 
 typedef struct {
@@ -46,12 +132,18 @@ typedef struct {
     double birth; // seconds (monotonic)
 } Segment;
 
+// The whole path is laid out when the bolt is created, each segment with the
+// time it appears. Births never decrease along the path, so the segments that
+// have appeared form a prefix [0, revealed) and the faded ones a prefix of
+// that: [seg_head, revealed) are the ones visible. The fade steps split the
+// rest the same way: from step_head[k] on segments are at fade step k or
+// younger.
 typedef struct {
-    int target_len;
-    bool growing;
-    double last_growth;
-    int max_y, max_x;
-    Segment *segs;
+    Segment *segs;  // a slot of the SegPool, seg_cap entries
+    int slot;
+    int seg_head;
+    int step_head[FADE_STEPS - 1];
+    int revealed;
     int seg_count;
     int seg_cap;
 } Bolt;
@@ -63,27 +155,138 @@ static double now_sec(void) {
     return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
 }
 
-static void sleep_sec(double s) {
-    if (s <= 0) return;
-    struct timespec req;
-    req.tv_sec = (time_t)s;
-    req.tv_nsec = (long)((s - req.tv_sec) * 1e9);
-    nanosleep(&req, NULL);
+static struct timespec timespec_from_sec(double s) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)s;
+    ts.tv_nsec = (long)((s - ts.tv_sec) * 1e9);
+    return ts;
+}
+
+// Time as seen by one simulation step or one rendered frame. It is sampled
+// once and passed down so per-segment loops never read the clock themselves.
+typedef struct {
+    double now;
+    double fade_cutoff;    // segments born before this have fully faded
+    double step_cutoff[FADE_STEPS - 1]; // born at or after: at fade step k or younger
+} FrameTime;
+
+static inline FrameTime frame_time_at(double now) {
+    FrameTime ft = { now, now - SEGMENT_LIFESPAN, {0} };
+    for (int k = 0; k < FADE_STEPS - 1; ++k) ft.step_cutoff[k] = now - SEGMENT_STEP_AGE[k] * SEGMENT_LIFESPAN;
+    return ft;
+}
+
+// Source of frame timestamps for the main loop: CLOCK_MONOTONIC, or a virtual
+// clock that advances a fixed step per frame (--virtual-clock) so a run is
+// reproduced exactly no matter how fast frames actually go out.
+typedef struct {
+    bool is_virtual;
+    double step; // virtual only: seconds per tick
+    double now;
+} FrameClock;
+
+static void frame_clock_init(FrameClock *c, bool is_virtual, double step) {
+    c->is_virtual = is_virtual;
+    c->step = step;
+    c->now = is_virtual ? 0.0 : now_sec();
+}
+
+// Starts a new frame whose wall-clock time is `wall` (ignored by a virtual
+// clock); returns seconds since the previous tick.
+static double frame_clock_tick(FrameClock *c, double wall) {
+    double t = c->is_virtual ? c->now + c->step : wall;
+    double dt = t - c->now;
+    c->now = t;
+    return dt;
+}
+
+// --- random numbers ---
+// xoshiro256** seeded through splitmix64. Each subsystem owns a stream, so
+// e.g. a density change in the rain spawner does not perturb bolt shapes for
+// the same --seed, and nothing goes through libc's locked rand().
+typedef struct { uint64_t s[4]; } Rng;
+
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void rng_seed(Rng *r, uint64_t seed, uint64_t stream) {
+    uint64_t x = seed ^ (stream * 0xd1b54a32d192ed03ULL);
+    for (int i = 0; i < 4; ++i) r->s[i] = splitmix64(&x);
+}
+
+static inline uint64_t rotl64(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+static inline uint64_t rng_next(Rng *r) {
+    uint64_t *s = r->s;
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return result;
+}
+
+// Uniform in [0, n); n == 0 yields 0.
+static inline int rng_below(Rng *r, int n) {
+    return (int)(((rng_next(r) >> 32) * (uint64_t)(uint32_t)n) >> 32);
 }
 
+// Uniform in [0, 1).
+static inline double rng_unit(Rng *r) {
+    return (double)(rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+static inline bool rng_chance(Rng *r, double p) { return rng_unit(r) < p; }
+
 // --- SIGWINCH handler for resize ---
+// signal() has System V semantics under _XOPEN_SOURCE, resetting a handler
+// after its first delivery, so handlers are installed with sigaction().
+static void set_signal(int signo, void (*handler)(int)) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(signo, &sa, NULL);
+}
+
 static void on_winch(int signo) {
     (void)signo;
     g_resized = 1;
 }
 
+// SIGINT/SIGTERM/SIGHUP with the ANSI backend: leave through the normal exit
+// path so the terminal gets restored.
+static void on_quit(int signo) {
+    (void)signo;
+    g_quit = 1;
+}
+
+// SIGTSTP (^Z): the main loop restores the terminal before the process stops.
+static void on_suspend(int signo) {
+    (void)signo;
+    g_suspend = 1;
+}
+
+// SIGUSR1/SIGUSR2, e.g. from a screen locker: stop and restart animation.
+static void on_idle(int signo) {
+    g_idle = signo == SIGUSR1 ? 1 : 2;
+}
+
 // --- color parsing ---
-typedef struct { const char *name; short code; } ColorMap;
+typedef struct { unsigned char r, g, b; } Rgb;
+typedef struct { const char *name; short code; Rgb rgb; } ColorMap;
 
+// The RGB values are xterm's, the base of the --colors 256|truecolor gradients.
 static const ColorMap COLOR_MAP[] = {
-    {"black", COLOR_BLACK}, {"red", COLOR_RED}, {"green", COLOR_GREEN},
-    {"yellow", COLOR_YELLOW}, {"blue", COLOR_BLUE}, {"magenta", COLOR_MAGENTA},
-    {"cyan", COLOR_CYAN}, {"white", COLOR_WHITE},
+    {"black", COLOR_BLACK, {0, 0, 0}},       {"red", COLOR_RED, {205, 0, 0}},
+    {"green", COLOR_GREEN, {0, 205, 0}},     {"yellow", COLOR_YELLOW, {205, 205, 0}},
+    {"blue", COLOR_BLUE, {0, 0, 238}},       {"magenta", COLOR_MAGENTA, {205, 0, 205}},
+    {"cyan", COLOR_CYAN, {0, 205, 205}},     {"white", COLOR_WHITE, {229, 229, 229}},
 };
 
 static short color_from_name(const char *s, short defval) {
@@ -95,298 +298,4357 @@ static short color_from_name(const char *s, short defval) {
     return defval;
 }
 
-// --- dynamic arrays (minimal) ---
-typedef struct {
-    Raindrop *v; int n, cap;
-} RainVec;
+static Rgb color_rgb(short code) {
+    for (size_t i = 0; i < sizeof(COLOR_MAP)/sizeof(COLOR_MAP[0]); ++i)
+        if (COLOR_MAP[i].code == code) return COLOR_MAP[i].rgb;
+    return COLOR_MAP[0].rgb;
+}
 
-typedef struct {
-    Bolt *v; int n, cap;
-} BoltVec;
+// --- gradients ---
+// --colors 256 or truecolor shades rain by speed and fades lightning in
+// FADE_STEPS colors instead of three glyphs. Each shade is a color pair of
+// its own (CP_RAIN_SHADE + shade, CP_FADE_STEP + step), so the curses backend
+// lets ncurses cache them and the ANSI one encodes each pair's SGR once.
+enum { COLORS_8, COLORS_256, COLORS_TRUE }; // --colors
+
+static Rgb rgb_scale(Rgb c, double f) {
+    Rgb out = { (unsigned char)(c.r * f + 0.5), (unsigned char)(c.g * f + 0.5), (unsigned char)(c.b * f + 0.5) };
+    return out;
+}
+
+static Rgb rgb_mix(Rgb a, Rgb b, double t) {
+    Rgb out = { (unsigned char)(a.r + (b.r - a.r) * t + 0.5), (unsigned char)(a.g + (b.g - a.g) * t + 0.5),
+                (unsigned char)(a.b + (b.b - a.b) * t + 0.5) };
+    return out;
+}
 
-static void rain_push(RainVec *rv, Raindrop d) {
-    if (rv->n == rv->cap) {
-        rv->cap = rv->cap ? rv->cap * 2 : 256;
-        rv->v = (Raindrop*)realloc(rv->v, rv->cap * sizeof(*rv->v));
+// Slow (far) drops at 30% of the rain color, the fastest at full strength.
+static Rgb rain_shade_rgb(Rgb base, int shade) {
+    return rgb_scale(base, 0.3 + 0.7 * shade / (RAIN_SHADES - 1));
+}
+
+// A new segment is white hot, cools to the lightning color by 40% of its
+// life and then dims to 40% of that.
+static Rgb fade_step_rgb(Rgb base, int step) {
+    static const Rgb WHITE = { 255, 255, 255 };
+    double t = (double)step / (FADE_STEPS - 1);
+    return t <= 0.4 ? rgb_mix(WHITE, base, t / 0.4) : rgb_scale(base, 1.0 - 0.6 * (t - 0.4) / 0.6);
+}
+
+// Nearest entry of the xterm 6x6x6 color cube (indexes 16-231).
+static short rgb_to_256(Rgb c) {
+    static const int LEVELS[6] = { 0, 95, 135, 175, 215, 255 };
+    int idx[3], v[3] = { c.r, c.g, c.b };
+    for (int i = 0; i < 3; ++i) {
+        idx[i] = 0;
+        for (int l = 1; l < 6; ++l)
+            if (abs(v[i] - LEVELS[l]) < abs(v[i] - LEVELS[idx[i]])) idx[i] = l;
     }
-    rv->v[rv->n++] = d;
+    return (short)(16 + 36 * idx[0] + 6 * idx[1] + idx[2]);
+}
+
+// --- heap ---
+// Every allocation of ours goes through these. Each block carries its size,
+// so the stats can show live bytes and how many allocations were made; with
+// --max-memory the buffers are sized against the live bytes at startup and
+// the allocation count stops moving once the main loop runs.
+typedef union { size_t n; max_align_t align; } HeapHeader;
+
+static atomic_long g_heap_allocs;  // successful heap_alloc/heap_calloc/heap_realloc calls
+static atomic_size_t g_heap_bytes; // live bytes handed out
+
+static void *heap_track(HeapHeader *h, size_t n, size_t old) {
+    if (!h) return NULL;
+    h->n = n;
+    atomic_fetch_add_explicit(&g_heap_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_heap_bytes, n - old, memory_order_relaxed); // wraps when shrinking
+    return h + 1;
+}
+
+static void *heap_alloc(size_t n) {
+    if (n > SIZE_MAX - sizeof(HeapHeader)) return NULL;
+    return heap_track((HeapHeader*)malloc(sizeof(HeapHeader) + n), n, 0);
+}
+
+static void *heap_calloc(size_t count, size_t size) {
+    if (size && count > (SIZE_MAX - sizeof(HeapHeader)) / size) return NULL;
+    return heap_track((HeapHeader*)calloc(1, sizeof(HeapHeader) + count * size), count * size, 0);
+}
+
+static void *heap_realloc(void *p, size_t n) {
+    if (!p) return heap_alloc(n);
+    if (n > SIZE_MAX - sizeof(HeapHeader)) return NULL;
+    HeapHeader *h = (HeapHeader*)p - 1;
+    size_t old = h->n;
+    return heap_track((HeapHeader*)realloc(h, sizeof(HeapHeader) + n), n, old);
+}
+
+static void heap_free(void *p) {
+    if (!p) return;
+    HeapHeader *h = (HeapHeader*)p - 1;
+    atomic_fetch_sub_explicit(&g_heap_bytes, h->n, memory_order_relaxed);
+    free(h);
 }
 
-static void boltvec_push(BoltVec *bv, Bolt b) {
+// --- dynamic arrays (minimal) ---
+typedef struct {
+    Bolt *v; int n, cap;
+} BoltVec;
+
+// False when there is no memory for the bolt.
+static bool boltvec_push(BoltVec *bv, Bolt b) {
     if (bv->n == bv->cap) {
-        bv->cap = bv->cap ? bv->cap * 2 : 64;
-        bv->v = (Bolt*)realloc(bv->v, bv->cap * sizeof(*bv->v));
+        int cap = bv->cap ? bv->cap * 2 : 64;
+        Bolt *v = (Bolt*)heap_realloc(bv->v, cap * sizeof(*v));
+        if (!v) return false;
+        bv->v = v;
+        bv->cap = cap;
     }
     bv->v[bv->n++] = b;
+    return true;
 }
 
+// Slots are sized for the longest bolt the grid allows (see bolt_slot_cap),
+// so running out of room means the bound is wrong; drop rather than overrun.
 static void seg_push(Bolt *b, Segment s) {
-    if (b->seg_count == b->seg_cap) {
-        b->seg_cap = b->seg_cap ? b->seg_cap * 2 : 64;
-        b->segs = (Segment*)realloc(b->segs, b->seg_cap * sizeof(*b->segs));
-    }
+    if (b->seg_count == b->seg_cap) return;
     b->segs[b->seg_count++] = s;
 }
 
-// --- lightning bolt ---
-static Bolt bolt_create(int start_row, int start_col, int max_y, int max_x) {
-    Bolt b;
-    b.max_y = max_y; b.max_x = max_x;
-    int min_len = max_y / 2;
-    if (min_len < 2) min_len = 2;
-    int max_len = max_y - 2;
-    if (max_len < min_len) max_len = min_len + 1;
-    b.target_len = (rand() % (max_len - min_len + 1)) + min_len;
-    b.growing = true;
-    b.last_growth = now_sec();
-    b.segs = NULL; b.seg_count = 0; b.seg_cap = 0;
-    Segment first = { start_row, start_col, now_sec() };
-    seg_push(&b, first);
-    return b;
+// --- bolt segment pool ---
+// One block of `nslots` fixed-size slots, one per bolt that may be alive at
+// once, backs every bolt's segments, so spawning and expiring bolts never
+// touches malloc; the block is only reallocated when the bolt limit changes
+// or a resize makes the longest possible bolt longer.
+typedef struct {
+    Segment *block;
+    int slot_cap;          // segments per slot
+    int nslots;
+    int *free_slots;       // nslots entries
+    int nfree;
+} SegPool;
+
+static void bolt_len_range(int max_y, int *min_len, int *max_len) {
+    *min_len = max_y / 2;
+    if (*min_len < 2) *min_len = 2;
+    *max_len = max_y - 2;
+    if (*max_len < *min_len) *max_len = *min_len + 1;
 }
 
-static bool bolt_update(Bolt *b) {
-    double t = now_sec();
+// A growth step of the path starts below its target length and adds at most
+// LIGHTNING_MAX_BRANCHES + 1 branch segments plus one fork.
+static int bolt_slot_cap(int max_y) {
+    int min_len, max_len;
+    bolt_len_range(max_y, &min_len, &max_len);
+    return max_len + LIGHTNING_MAX_BRANCHES + 1;
+}
 
-    if (b->growing && (t - b->last_growth) >= LIGHTNING_GROWTH_DELAY) {
-        b->last_growth = t;
-        bool added = false;
+// All slots must be free (no live bolts) when this is called.
+static bool seg_pool_reserve(SegPool *p, int nslots, int max_y) {
+    int cap = bolt_slot_cap(max_y);
+    if (cap < p->slot_cap) cap = p->slot_cap;
+    if (cap != p->slot_cap || nslots != p->nslots) {
+        Segment *block = (Segment*)heap_realloc(p->block, (size_t)nslots * cap * sizeof(*block));
+        if (!block) return false;
+        p->block = block;
+        p->slot_cap = cap;
+    }
+    if (nslots != p->nslots) {
+        int *free_slots = (int*)heap_realloc(p->free_slots, nslots * sizeof(*free_slots));
+        if (!free_slots) return false;
+        p->free_slots = free_slots;
+        p->nslots = nslots;
+    }
+    p->nfree = nslots;
+    for (int i = 0; i < nslots; ++i) p->free_slots[i] = nslots - 1 - i;
+    return true;
+}
 
-        Segment last = b->segs[b->seg_count - 1];
-        if (b->seg_count < b->target_len && last.y < b->max_y - 1) {
-            int branches = 1;
-            if (((double)rand()/RAND_MAX) < LIGHTNING_BRANCH_CHANCE) {
-                branches = (rand() % (LIGHTNING_MAX_BRANCHES + 1)) + 1;
-            }
+// Resize with live bolts: slots keep their contents, moved to their new
+// offsets when the slot size grows. Callers re-point each bolt's segs.
+static bool seg_pool_regrow(SegPool *p, int max_y) {
+    int cap = bolt_slot_cap(max_y), old = p->slot_cap;
+    if (cap <= old) return true;
+    Segment *block = (Segment*)heap_realloc(p->block, (size_t)p->nslots * cap * sizeof(*block));
+    if (!block) return false;
+    for (int slot = p->nslots - 1; slot > 0; --slot)
+        memmove(block + (size_t)slot * cap, block + (size_t)slot * old, (size_t)old * sizeof(*block));
+    p->block = block;
+    p->slot_cap = cap;
+    return true;
+}
 
-            int current_x = last.x;
-            int primary_next_x = current_x;
-
-            for (int i = 0; i < branches; ++i) {
-                int offset = (rand() % 5) - 2; // [-2,2]
-                int nx = current_x + offset;
-                if (nx < 0) nx = 0;
-                if (nx >= b->max_x) nx = b->max_x - 1;
-                int ny = last.y + 1;
-                if (ny >= b->max_y) ny = b->max_y - 1;
-                Segment s = { ny, nx, t };
-                seg_push(b, s);
-                if (i == 0) primary_next_x = nx;
-                current_x = nx;
-                added = true;
-            }
+static int seg_pool_acquire(SegPool *p) {
+    return p->nfree ? p->free_slots[--p->nfree] : -1;
+}
 
-            if (((double)rand()/RAND_MAX) < FORK_CHANCE) {
-                int off = (rand() % (2*FORK_HORIZONTAL_SPREAD + 1)) - FORK_HORIZONTAL_SPREAD;
-                if (off == 0) off = (rand()%2) ? -1 : 1;
-                int fx = last.x + off;
-                if (fx < 0) fx = 0;
-                if (fx >= b->max_x) fx = b->max_x - 1;
-                int fy = last.y + 1;
-                if (fy >= b->max_y) fy = b->max_y - 1;
-                if (fx != primary_next_x) {
-                    Segment s = { fy, fx, t };
-                    seg_push(b, s);
-                    added = true;
-                }
-            }
-        }
+static void seg_pool_release(SegPool *p, int slot) {
+    p->free_slots[p->nfree++] = slot;
+}
+
+static void seg_pool_free(SegPool *p) {
+    heap_free(p->block);
+    heap_free(p->free_slots);
+    memset(p, 0, sizeof(*p));
+}
+
+// --- drawing target ---
+// Everything is drawn through a Canvas so the same code paths can paint either
+// stdscr or an off-screen cell buffer (used by --bench, which has no TTY).
+//
+// With damage tracking (--damage) the Canvas composes into `cells` and
+// canvas_present() sends ncurses only the cells that differ from `shadow`,
+// the copy of what is on the terminal. `touched` lists the cells drawn this
+// frame and `prev` those drawn last frame, so clearing vacated cells and
+// finding changed ones costs O(drawn cells) instead of O(rows*cols). A cell
+// value of 0 means empty in both buffers.
+//
+// To save output (--max-bytes-per-sec) a present can send only every
+// row_step-th row, starting at row_phase, which rotates. A row passed over
+// with changes in it is marked stale: the lists only cover two frames, so on
+// its next turn it is compared with the shadow in full.
+typedef struct {
+    int rows, cols;
+    chtype *cells;  // rows*cols, or NULL to draw straight to stdscr
+    chtype *shadow; // damage tracking only
+    int *touched, ntouched;
+    int *prev, nprev;
+    uint64_t hash;  // of everything drawn since canvas_clear(), to spot static frames
+    size_t cap;     // cells the buffers have room for
+    int row_step, row_phase;
+    unsigned char *stale; // per row, damage tracking only
+    int stale_cap;
+} Canvas;
+
+static bool canvas_init_damage(Canvas *cv, int rows, int cols) {
+    size_t n = (size_t)rows * cols;
+    cv->rows = rows; cv->cols = cols;
+    cv->cells   = heap_calloc(n, sizeof(*cv->cells));
+    cv->shadow  = heap_calloc(n, sizeof(*cv->shadow));
+    cv->touched = heap_alloc(n * sizeof(*cv->touched));
+    cv->prev    = heap_alloc(n * sizeof(*cv->prev));
+    cv->stale   = heap_calloc(rows, sizeof(*cv->stale));
+    cv->ntouched = cv->nprev = 0;
+    cv->cap = n;
+    cv->stale_cap = rows;
+    cv->row_step = 1;
+    cv->row_phase = 0;
+    return cv->cells && cv->shadow && cv->touched && cv->prev && cv->stale;
+}
+
+// A frame buffer: cells and the list of those drawn, no shadow, so clearing
+// undoes only what was drawn.
+static bool canvas_init_frame(Canvas *cv, int rows, int cols) {
+    *cv = (Canvas){ .rows = rows, .cols = cols, .cap = (size_t)rows * cols, .row_step = 1 };
+    cv->cells = (chtype*)heap_calloc((size_t)rows * cols, sizeof(*cv->cells));
+    cv->touched = (int*)heap_alloc((size_t)rows * cols * sizeof(*cv->touched));
+    return cv->cells && cv->touched;
+}
 
-        if (!added || b->seg_count >= b->target_len || last.y >= b->max_y - 1) {
-            b->growing = false;
+// Gives a cell-buffer canvas a new size, keeping whichever buffers it has
+// and reallocating them only to grow. Everything is blank afterwards.
+static bool canvas_resize(Canvas *cv, int rows, int cols) {
+    size_t n = (size_t)rows * cols;
+    if (n > cv->cap) {
+        chtype *cells = (chtype*)heap_realloc(cv->cells, n * sizeof(*cells));
+        if (!cells) return false;
+        cv->cells = cells;
+        if (cv->shadow) {
+            chtype *shadow = (chtype*)heap_realloc(cv->shadow, n * sizeof(*shadow));
+            if (!shadow) return false;
+            cv->shadow = shadow;
         }
+        if (cv->touched) {
+            int *touched = (int*)heap_realloc(cv->touched, n * sizeof(*touched));
+            if (!touched) return false;
+            cv->touched = touched;
+        }
+        if (cv->prev) {
+            int *prev = (int*)heap_realloc(cv->prev, n * sizeof(*prev));
+            if (!prev) return false;
+            cv->prev = prev;
+        }
+        cv->cap = n;
     }
+    if (cv->stale && rows > cv->stale_cap) {
+        unsigned char *stale = (unsigned char*)heap_realloc(cv->stale, rows * sizeof(*stale));
+        if (!stale) return false;
+        cv->stale = stale;
+        cv->stale_cap = rows;
+    }
+    cv->rows = rows;
+    cv->cols = cols;
+    memset(cv->cells, 0, n * sizeof(*cv->cells));
+    if (cv->shadow) memset(cv->shadow, 0, n * sizeof(*cv->shadow));
+    if (cv->stale) memset(cv->stale, 0, rows * sizeof(*cv->stale));
+    cv->ntouched = cv->nprev = 0;
+    cv->row_phase = 0;
+    return true;
+}
+
+static void canvas_free(Canvas *cv) {
+    heap_free(cv->cells); heap_free(cv->shadow); heap_free(cv->touched); heap_free(cv->prev);
+    heap_free(cv->stale);
+    cv->cells = cv->shadow = NULL;
+    cv->touched = cv->prev = NULL;
+    cv->stale = NULL;
+}
+
+// Changes row_step, keeping row_phase one of the new step's residues so
+// every row still comes due.
+static void canvas_set_row_step(Canvas *cv, int step) {
+    if (step == cv->row_step) return;
+    cv->row_step = step;
+    cv->row_phase = step > 1 ? cv->row_phase % step : 0;
+}
 
-    // prune if all segments expired
-    bool any_alive = false;
-    for (int i = 0; i < b->seg_count; ++i) {
-        if ((now_sec() - b->segs[i].birth) <= SEGMENT_LIFESPAN) { any_alive = true; break; }
+// Whether this present sends row y; see row_step.
+static inline bool canvas_row_due(const Canvas *cv, int y) {
+    return cv->row_step <= 1 || y % cv->row_step == cv->row_phase;
+}
+
+static void canvas_clear(Canvas *cv) {
+    cv->hash = 0;
+    if (!cv->cells) erase();
+    else if (cv->shadow) return; // damage tracking: canvas_present() already emptied what it drew
+    else if (cv->touched) {
+        // A frame buffer (see Presenter): only what was drawn needs undoing.
+        for (int k = 0; k < cv->ntouched; ++k) cv->cells[cv->touched[k]] = 0;
+        cv->ntouched = 0;
+    } else {
+        memset(cv->cells, 0, (size_t)cv->rows * cv->cols * sizeof(*cv->cells));
     }
-    return any_alive;
 }
 
-static void bolt_draw(const Bolt *b, chtype l_attr) {
-    double t = now_sec();
-    int max_idx = 2; // '*','#','+' index via mapping below
+// The terminal was cleared behind our back (clear(), resize): forget what we
+// believe is on it so the next present repaints every drawn cell.
+static void canvas_invalidate(Canvas *cv) {
+    if (!cv->shadow) return;
+    memset(cv->shadow, 0, (size_t)cv->rows * cv->cols * sizeof(*cv->shadow));
+}
+
+// Caller guarantees 0 <= y < rows and 0 <= x < cols.
+static inline void canvas_put(Canvas *cv, int y, int x, chtype ch) {
+    int i = y * cv->cols + x;
+    cv->hash = (cv->hash ^ (((uint64_t)i << 32) | ch)) * 0x100000001b3ULL;
+    if (!cv->cells) { mvaddch(y, x, ch); return; }
+    if (cv->touched && cv->cells[i] == 0) cv->touched[cv->ntouched++] = i;
+    cv->cells[i] = ch;
+}
 
-    for (int i = 0; i < b->seg_count; ++i) {
-        double age = t - b->segs[i].birth;
-        if (age > SEGMENT_LIFESPAN) continue;
-        double norm = age / SEGMENT_LIFESPAN; // 0..1
-        int char_idx;
-        if (norm < 0.33) char_idx = 2;      // '#'
-        else if (norm < 0.66) char_idx = 1; // '+'
-        else char_idx = 0;                  // '*'
-        if (char_idx < 0)
-            char_idx = 0;
-        if (char_idx > max_idx)
-            char_idx = max_idx;
+// canvas_put() for a worker thread that owns a disjoint set of columns of a
+// cell-buffer canvas: newly drawn cells and the hash go to the caller's own
+// list, which the main thread folds in with canvas_merge().
+static inline void canvas_put_local(Canvas *cv, int y, int x, chtype ch,
+                                    int *touched, int *ntouched, uint64_t *hash) {
+    int i = y * cv->cols + x;
+    *hash = (*hash ^ (((uint64_t)i << 32) | ch)) * 0x100000001b3ULL;
+    if (cv->touched && cv->cells[i] == 0) touched[(*ntouched)++] = i;
+    cv->cells[i] = ch;
+}
 
-        int y = b->segs[i].y, x = b->segs[i].x;
-        if (y >= 0 && y < g_rows && x >= 0 && x < g_cols) {
-            mvaddch(y, x, LIGHTNING_CHARS[char_idx] | l_attr);
-        }
+static void canvas_merge(Canvas *cv, const int *touched, int n, uint64_t hash) {
+    if (cv->touched) {
+        memcpy(cv->touched + cv->ntouched, touched, n * sizeof(*touched));
+        cv->ntouched += n;
     }
+    cv->hash = (cv->hash * 0x9e3779b97f4a7c15ULL) ^ hash;
 }
 
-// --- main sim ---
-static void setup_colors(const char *rain_name, const char *lightning_name, chtype *rain_attr, chtype *light_attr) {
-    *rain_attr = A_NORMAL;
-    *light_attr = A_BOLD;
+// Per-cell occupancy for the frame being drawn: which layer holds each cell,
+// so a draw the cell would not show is dropped before it reaches the canvas
+// and nothing is drawn twice. Each cell stores the frame generation that last
+// claimed it and that layer's z, so starting a new frame is a counter bump
+// and resolving any draw is O(1), whatever else covers the screen.
+enum { Z_RAIN = 1, Z_BOLT = 2 }; // higher covers lower
+#define ZGRID_Z_BITS 2
+#define ZGRID_GEN_MAX (UINT32_MAX >> ZGRID_Z_BITS)
 
-    if (!has_colors()) return;
+typedef struct {
+    uint32_t *stamp; // gen << ZGRID_Z_BITS | z
+    size_t n;
+    uint32_t gen;
+} ZGrid;
 
-    start_color();
-#ifdef NCURSES_VERSION
-    use_default_colors();
-#endif
+static bool zgrid_reserve(ZGrid *g, size_t n) {
+    if (n > g->n) {
+        heap_free(g->stamp);
+        g->stamp = (uint32_t*)heap_calloc(n, sizeof(*g->stamp));
+        g->n = g->stamp ? n : 0;
+        g->gen = 0;
+        if (!g->stamp) return false;
+    }
+    return true;
+}
 
-    short bg = -1;
-    short rain_fg = color_from_name(rain_name, COLOR_CYAN);
-    short light_fg = color_from_name(lightning_name, COLOR_YELLOW);
+static void zgrid_reset(ZGrid *g) {
+    if (++g->gen > ZGRID_GEN_MAX) {
+        memset(g->stamp, 0, g->n * sizeof(*g->stamp));
+        g->gen = 1;
+    }
+}
 
-    init_pair(CP_RAIN_NORMAL, rain_fg, bg);
-    init_pair(CP_LIGHTNING,   light_fg, bg);
+// True if layer z gets cell i: nothing at z or above has claimed it yet this
+// frame. Threads may claim concurrently as long as their cells are disjoint.
+static inline bool zgrid_claim(ZGrid *g, int i, unsigned z) {
+    uint32_t v = g->stamp[i];
+    if ((v >> ZGRID_Z_BITS) == g->gen && (v & ((1u << ZGRID_Z_BITS) - 1)) >= z) return false;
+    g->stamp[i] = g->gen << ZGRID_Z_BITS | z;
+    return true;
+}
 
-    *rain_attr  = COLOR_PAIR(CP_RAIN_NORMAL);
-    *light_attr = COLOR_PAIR(CP_LIGHTNING) | A_BOLD;
+static void zgrid_free(ZGrid *g) {
+    heap_free(g->stamp);
+    memset(g, 0, sizeof(*g));
 }
 
-int main(int argc, char **argv) {
-    // Parse options
-    const char *rain_color = "cyan";
-    const char *light_color = "yellow";
-
-    static struct option long_opts[] = {
-        {"rain-color", required_argument, 0, 'r'},
-        {"lightning-color", required_argument, 0, 'l'},
-        {0,0,0,0}
-    };
-    int c;
-    while ((c = getopt_long(argc, argv, "r:l:", long_opts, NULL)) != -1) {
-        if (c == 'r') rain_color = optarg;
-        else if (c == 'l') light_color = optarg;
+// Writes `str` starting at (y, x), clipped to the canvas.
+static void canvas_puts(Canvas *cv, int y, int x, const char *str, chtype attr) {
+    if (y < 0 || y >= cv->rows) return;
+    for (; *str && x < cv->cols; ++str, ++x) {
+        if (x >= 0) canvas_put(cv, y, x, (unsigned char)*str | attr);
     }
+}
 
-    if (!isatty(STDOUT_FILENO) || getenv("TERM") == NULL || strcmp(getenv("TERM"), "dumb") == 0) {
-        fprintf(stderr, "Error: This program requires a real TTY.\n");
-        return 1;
+// Once a damage-tracked frame has been presented: empty the compose buffer and
+// make this frame's cells the "previous" ones.
+static void canvas_end_frame(Canvas *cv) {
+    for (int k = 0; k < cv->ntouched; ++k) cv->cells[cv->touched[k]] = 0;
+    if (cv->row_step > 1) cv->row_phase = (cv->row_phase + 1) % cv->row_step;
+
+    int *t = cv->prev; cv->prev = cv->touched; cv->touched = t;
+    cv->nprev = cv->ntouched;
+    cv->ntouched = 0;
+}
+
+// Damage tracking only: push the composed frame to stdscr, then reset the
+// compose buffer for the next frame.
+static void canvas_present(Canvas *cv) {
+    for (int k = 0; k < cv->nprev; ++k) {
+        int i = cv->prev[k], y = i / cv->cols;
+        if (!canvas_row_due(cv, y)) { cv->stale[y] = 1; continue; }
+        if (cv->cells[i] == 0 && cv->shadow[i] != 0) {
+            mvaddch(y, i % cv->cols, ' ');
+            cv->shadow[i] = 0;
+        }
+    }
+    for (int k = 0; k < cv->ntouched; ++k) {
+        int i = cv->touched[k], y = i / cv->cols;
+        if (!canvas_row_due(cv, y)) { cv->stale[y] = 1; continue; }
+        if (cv->cells[i] != cv->shadow[i]) {
+            mvaddch(y, i % cv->cols, cv->cells[i]);
+            cv->shadow[i] = cv->cells[i];
+        }
     }
+    int step = cv->row_step > 1 ? cv->row_step : 1;
+    for (int y = step > 1 ? cv->row_phase : 0; y < cv->rows; y += step) {
+        if (!cv->stale[y]) continue;
+        cv->stale[y] = 0;
+        for (int x = 0, i = y * cv->cols; x < cv->cols; ++x, ++i) {
+            if (cv->cells[i] == cv->shadow[i]) continue;
+            mvaddch(y, x, cv->cells[i] ? cv->cells[i] : ' ');
+            cv->shadow[i] = cv->cells[i];
+        }
+    }
+    canvas_end_frame(cv);
+}
 
-    srand((unsigned)time(NULL));
+// What a new drop starts as; see sim_build_templates().
+typedef struct {
+    float speed;
+    unsigned char look;
+} DropTemplate;
 
-    initscr();
-    cbreak();
-    noecho();
-    keypad(stdscr, TRUE);
-    nodelay(stdscr, TRUE);
-    timeout(1); // getch timeout (ms)
-    curs_set(0);
+// --- raindrop storage ---
+// Drops are kept as parallel arrays so the advance/compact pass streams
+// through 13 bytes per drop and maps directly onto SIMD lanes.
+typedef struct {
+    float *y, *speed;
+    int *x;
+    unsigned char *look;
+    int n, cap;
+    int limit; // --max-memory: cap is fixed at this many drops; 0: grows as needed
+} RainVec;
 
-    // Handle resize
-    signal(SIGWINCH, on_winch);
+#define RAIN_DROP_BYTES (2 * sizeof(float) + sizeof(int) + 1)
 
-    getmaxyx(stdscr, g_rows, g_cols);
+// Exactly `cap` drops of storage; the newest drops go if there were more.
+static bool rain_set_cap(RainVec *rv, int cap) {
+    float *y = (float*)heap_realloc(rv->y, cap * sizeof(*y));
+    if (y) rv->y = y;
+    float *speed = (float*)heap_realloc(rv->speed, cap * sizeof(*speed));
+    if (speed) rv->speed = speed;
+    int *x = (int*)heap_realloc(rv->x, cap * sizeof(*x));
+    if (x) rv->x = x;
+    unsigned char *look = (unsigned char*)heap_realloc(rv->look, cap * sizeof(*look));
+    if (look) rv->look = look;
+    if (!y || !speed || !x || !look) return false;
+    rv->cap = cap;
+    if (rv->n > cap) rv->n = cap;
+    return true;
+}
 
-    chtype rain_attr, light_attr;
-    setup_colors(rain_color, light_color, &rain_attr, &light_attr);
+// Room for `need` drops; false when out of memory or past the limit.
+static bool rain_reserve(RainVec *rv, int need) {
+    if (need <= rv->cap) return true;
+    if (rv->limit) return false;
+    int cap = rv->cap ? rv->cap : 256;
+    while (cap < need) cap *= 2;
+    return rain_set_cap(rv, cap);
+}
 
-    RainVec rain = {0};
-    BoltVec bolts = {0};
+static bool rain_push(RainVec *rv, Raindrop d) {
+    if (rv->n == rv->cap && !rain_reserve(rv, rv->n + 1)) return false;
+    int i = rv->n++;
+    rv->x[i] = d.x;
+    rv->y[i] = d.y;
+    rv->speed[i] = d.speed;
+    rv->look[i] = d.look;
+    return true;
+}
 
-    bool thunder = false;
-    double last = now_sec();
+static void rain_free(RainVec *rv) {
+    heap_free(rv->y); heap_free(rv->speed); heap_free(rv->x); heap_free(rv->look);
+    memset(rv, 0, sizeof(*rv));
+}
 
-    while (1) {
-        if (g_resized) {
-            g_resized = 0;
-#ifdef NCURSES_VERSION
-            endwin(); refresh();
-#endif
-            getmaxyx(stdscr, g_rows, g_cols);
-            clear();
-            rain.n = 0;
-            for (int i = 0; i < bolts.n; ++i) { free(bolts.v[i].segs); }
-            bolts.n = 0;
+// Each kernel moves every drop by speed*dt and compacts away drops that have
+// fallen past `rows`, keeping survivors in order. Drops are never above row 0,
+// so (int)y < rows is the same test as y < rows. The vector kernels handle
+// whole chunks and hand the remainder [i, n) to the scalar one with `w`
+// survivors written so far.
+static int rain_advance_scalar(RainVec *rv, int i, int w, float dt, float rows) {
+    for (; i < rv->n; ++i) {
+        float y = rv->y[i] + rv->speed[i] * dt;
+        if (y < rows) {
+            rv->y[w] = y;
+            rv->speed[w] = rv->speed[i];
+            rv->x[w] = rv->x[i];
+            rv->look[w] = rv->look[i];
+            ++w;
         }
+    }
+    return w;
+}
+
+// Copies the surviving lanes of a 4-wide chunk whose new y values are in `ny`.
+static inline int rain_keep_lanes(RainVec *rv, int i, int w, const float *ny, int mask) {
+    for (int l = 0; l < 4; ++l) {
+        if (!(mask & (1 << l))) continue;
+        rv->y[w] = ny[l];
+        rv->speed[w] = rv->speed[i + l];
+        rv->x[w] = rv->x[i + l];
+        rv->look[w] = rv->look[i + l];
+        ++w;
+    }
+    return w;
+}
 
-        int ch = getch();
-        if (ch == 'q' || ch == 'Q' || ch == 27) break;
-        if (ch == 't' || ch == 'T') {
-            thunder = !thunder;
-            clear();
+#if RAIN_SIMD_X86
+static int rain_advance_sse2(RainVec *rv, float dt, float rows) {
+    const __m128 vdt = _mm_set1_ps(dt), vrows = _mm_set1_ps(rows);
+    int n = rv->n, i = 0, w = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 sp = _mm_loadu_ps(rv->speed + i);
+        __m128 y = _mm_add_ps(_mm_loadu_ps(rv->y + i), _mm_mul_ps(sp, vdt));
+        int mask = _mm_movemask_ps(_mm_cmplt_ps(y, vrows));
+        if (mask == 0xf) {
+            _mm_storeu_ps(rv->y + w, y);
+            if (w != i) {
+                _mm_storeu_ps(rv->speed + w, sp);
+                _mm_storeu_si128((__m128i*)(rv->x + w), _mm_loadu_si128((const __m128i*)(rv->x + i)));
+                memmove(rv->look + w, rv->look + i, 4);
+            }
+            w += 4;
+        } else if (mask) {
+            float ny[4];
+            _mm_storeu_ps(ny, y);
+            w = rain_keep_lanes(rv, i, w, ny, mask);
         }
+    }
+    return rain_advance_scalar(rv, i, w, dt, rows);
+}
 
-        double now = now_sec();
-        double dt = now - last;
-        if (dt < UPDATE_INTERVAL) sleep_sec(UPDATE_INTERVAL - dt);
-        last = now_sec();
+#if defined(__GNUC__)
+#define RAIN_SIMD_AVX2 1
+// COMPACT_LUT[mask] lists the set lanes of an 8-bit mask first, so a single
+// permute packs the survivors of a chunk to the front.
+static int32_t COMPACT_LUT[256][8];
 
-        if (thunder && bolts.n < 3 && ((double)rand()/RAND_MAX) < LIGHTNING_CHANCE) {
-            int start_col = (g_cols/4) + (rand() % (g_cols/2));
-            int start_row = rand() % ((g_rows > 5) ? (g_rows/5) : g_rows);
-            Bolt b = bolt_create(start_row, start_col, g_rows, g_cols);
-            boltvec_push(&bolts, b);
+static void compact_lut_init(void) {
+    for (int m = 0; m < 256; ++m) {
+        int k = 0;
+        for (int l = 0; l < 8; ++l) if (m & (1 << l)) COMPACT_LUT[m][k++] = l;
+        while (k < 8) COMPACT_LUT[m][k++] = 0;
+    }
+}
+
+__attribute__((target("avx2")))
+static int rain_advance_avx2(RainVec *rv, float dt, float rows) {
+    const __m256 vdt = _mm256_set1_ps(dt), vrows = _mm256_set1_ps(rows);
+    int n = rv->n, i = 0, w = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 sp = _mm256_loadu_ps(rv->speed + i);
+        __m256 y = _mm256_add_ps(_mm256_loadu_ps(rv->y + i), _mm256_mul_ps(sp, vdt));
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(y, vrows, _CMP_LT_OQ));
+        if (mask == 0xff && w == i) {
+            _mm256_storeu_ps(rv->y + i, y);
+            w += 8;
+            continue;
         }
+        // Stores may spill past the survivors, but only over lanes of this
+        // chunk that have already been loaded (w <= i).
+        __m256i perm = _mm256_loadu_si256((const __m256i*)COMPACT_LUT[mask]);
+        __m256i x = _mm256_loadu_si256((const __m256i*)(rv->x + i));
+        _mm256_storeu_ps(rv->y + w, _mm256_permutevar8x32_ps(y, perm));
+        _mm256_storeu_ps(rv->speed + w, _mm256_permutevar8x32_ps(sp, perm));
+        _mm256_storeu_si256((__m256i*)(rv->x + w), _mm256_permutevar8x32_epi32(x, perm));
+        int k = w;
+        for (int m = mask; m; m &= m - 1) rv->look[k++] = rv->look[i + __builtin_ctz(m)];
+        w = k;
+    }
+    return rain_advance_scalar(rv, i, w, dt, rows);
+}
+#endif
+#endif
 
-        int w = 0;
-        for (int i = 0; i < bolts.n; ++i) {
-            if (bolt_update(&bolts.v[i])) {
-                bolts.v[w++] = bolts.v[i];
-            } else {
-                free(bolts.v[i].segs);
+#if RAIN_SIMD_NEON
+static int rain_advance_neon(RainVec *rv, float dt, float rows) {
+    const float32x4_t vrows = vdupq_n_f32(rows);
+    static const uint32_t lane_bits[4] = { 1, 2, 4, 8 };
+    const uint32x4_t vbits = vld1q_u32(lane_bits);
+    int n = rv->n, i = 0, w = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t sp = vld1q_f32(rv->speed + i);
+        float32x4_t y = vmlaq_n_f32(vld1q_f32(rv->y + i), sp, dt);
+        // Pairwise adds rather than vaddvq_u32, which is AArch64-only.
+        uint32x4_t m = vandq_u32(vcltq_f32(y, vrows), vbits);
+        uint32x2_t m2 = vpadd_u32(vget_low_u32(m), vget_high_u32(m));
+        int mask = (int)vget_lane_u32(vpadd_u32(m2, m2), 0);
+        if (mask == 0xf) {
+            vst1q_f32(rv->y + w, y);
+            if (w != i) {
+                vst1q_f32(rv->speed + w, sp);
+                vst1q_s32(rv->x + w, vld1q_s32(rv->x + i));
+                memmove(rv->look + w, rv->look + i, 4);
             }
+            w += 4;
+        } else if (mask) {
+            float ny[4];
+            vst1q_f32(ny, y);
+            w = rain_keep_lanes(rv, i, w, ny, mask);
         }
-        bolts.n = w;
-
-        double gen_chance = thunder ? 0.5 : 0.3;
-        int max_new = thunder ? (g_cols/8) : (g_cols/15);
-        double min_speed = 0.3;
-        double max_speed = thunder ? 1.0 : 0.6;
-
-        if (((double)rand()/RAND_MAX) < gen_chance) {
-            int n_new = 1 + (max_new > 1 ? rand() % max_new : 0);
-            for (int i = 0; i < n_new; ++i) {
-                Raindrop d;
-                d.x = rand() % (g_cols > 1 ? g_cols : 1);
-                d.y = 0.0;
-                d.speed = min_speed + ((double)rand()/RAND_MAX) * (max_speed - min_speed);
-                char ra_chars[] = {'|', '.', '`'};
-                d.ch = ra_chars[rand()%3];
-                rain_push(&rain, d);
-            }
+    }
+    return rain_advance_scalar(rv, i, w, dt, rows);
+}
+#endif
+
+typedef int (*RainAdvanceFn)(RainVec *rv, float dt, float rows);
+static RainAdvanceFn rain_advance_kernel;
+static const char *rain_kernel_name = "scalar";
+
+static int rain_advance_scalar_all(RainVec *rv, float dt, float rows) {
+    return rain_advance_scalar(rv, 0, 0, dt, rows);
+}
+
+// Picks the widest kernel this CPU supports; call once before simulating.
+static void rain_kernel_init(void) {
+    rain_advance_kernel = rain_advance_scalar_all;
+    rain_kernel_name = "scalar";
+#if RAIN_SIMD_X86
+    rain_advance_kernel = rain_advance_sse2;
+    rain_kernel_name = "sse2";
+#if RAIN_SIMD_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        compact_lut_init();
+        rain_advance_kernel = rain_advance_avx2;
+        rain_kernel_name = "avx2";
+    }
+#endif
+#elif RAIN_SIMD_NEON
+    rain_advance_kernel = rain_advance_neon;
+    rain_kernel_name = "neon";
+#endif
+}
+
+static void rain_advance(RainVec *rv, float dt, int rows) {
+    rv->n = rain_advance_kernel(rv, dt, (float)rows);
+}
+
+// --- rain columns ---
+// The other engine (--rain-engine columns): each column keeps its drops in a
+// ring ordered by when they will fall past the bottom, (rows - y) / speed.
+// Drops move linearly, so that order never changes while they fall (a fast
+// drop overtaking a slow one included) and scaling on resize keeps it too:
+// advancing is a plain pass over each ring, culling pops from the front, and
+// advancing, culling and drawing walk one column's drops contiguously instead
+// of scattering over the screen. Only spawning searches for its slot, from
+// the back, where a new drop mostly belongs.
+enum { RAIN_ENGINE_VECTOR, RAIN_ENGINE_COLUMNS };
+
+#define RAIN_COL_INITIAL_CAP 8 // drops per column ring; doubles when one fills
+
+typedef struct {
+    float y, speed;
+    unsigned char look;
+} ColDrop;
+
+typedef struct { int head, count; } ColRing;
+
+typedef struct {
+    ColDrop *drops;  // ncols rings of `cap` slots, cap a power of two
+    ColRing *rings;
+    int x0, ncols, cap;
+    int n;           // drops over all columns
+    bool fixed;      // --max-memory: rings never grow, a full column drops spawns
+} RainCols;
+
+#define RCOL_AT(rc, c, k) (&(rc)->drops[(size_t)(c) * (rc)->cap + (((rc)->rings[c].head + (k)) & ((rc)->cap - 1))])
+
+// Empty rings for columns [x0, x0 + ncols).
+static bool rcols_layout(RainCols *rc, int x0, int ncols) {
+    if (rc->cap == 0) rc->cap = RAIN_COL_INITIAL_CAP;
+    if (ncols > rc->ncols || !rc->drops) {
+        ColDrop *d = (ColDrop*)heap_realloc(rc->drops, (size_t)(ncols ? ncols : 1) * rc->cap * sizeof(*d));
+        if (!d) return false;
+        rc->drops = d;
+        ColRing *r = (ColRing*)heap_realloc(rc->rings, (size_t)(ncols ? ncols : 1) * sizeof(*r));
+        if (!r) return false;
+        rc->rings = r;
+    }
+    rc->x0 = x0;
+    rc->ncols = ncols;
+    rc->n = 0;
+    memset(rc->rings, 0, (size_t)ncols * sizeof(*rc->rings));
+    return true;
+}
+
+// Re-lays every ring with `cap` slots (a power of two), unwrapping each to
+// start at slot 0; a column with more drops keeps those leaving first.
+static bool rcols_set_cap(RainCols *rc, int cap) {
+    ColDrop *d = (ColDrop*)heap_alloc((size_t)(rc->ncols ? rc->ncols : 1) * cap * sizeof(*d));
+    if (!d) return false;
+    rc->n = 0;
+    for (int c = 0; c < rc->ncols; ++c) {
+        ColRing *r = &rc->rings[c];
+        if (r->count > cap) r->count = cap;
+        for (int k = 0; k < r->count; ++k) d[(size_t)c * cap + k] = *RCOL_AT(rc, c, k);
+        r->head = 0;
+        rc->n += r->count;
+    }
+    heap_free(rc->drops);
+    rc->drops = d;
+    rc->cap = cap;
+    return true;
+}
+
+static void rcols_insert(RainCols *rc, int c, float y, float speed, unsigned char look, int rows) {
+    ColRing *r = &rc->rings[c];
+    if (r->count == rc->cap && (rc->fixed || !rcols_set_cap(rc, rc->cap * 2))) return;
+    float left = (float)rows - y;
+    int k = r->count++;
+    for (; k > 0; --k) { // while the one before leaves later: (rows - p.y) / p.speed > left / speed
+        const ColDrop *p = RCOL_AT(rc, c, k - 1);
+        if (((float)rows - p->y) * speed <= left * p->speed) break;
+        *RCOL_AT(rc, c, k) = *p;
+    }
+    *RCOL_AT(rc, c, k) = (ColDrop){ y, speed, look };
+    ++rc->n;
+}
+
+static void rcols_advance(RainCols *rc, float dt, int rows) {
+    unsigned mask = (unsigned)rc->cap - 1;
+    for (int c = 0; c < rc->ncols; ++c) {
+        ColRing *r = &rc->rings[c];
+        if (r->count == 0) continue;
+        ColDrop *ring = rc->drops + (size_t)c * rc->cap;
+        unsigned h = (unsigned)r->head;
+        for (unsigned k = 0; k < (unsigned)r->count; ++k) {
+            ColDrop *d = &ring[(h + k) & mask];
+            d->y += d->speed * dt;
         }
+        while (r->count > 0 && ring[h].y >= (float)rows) {
+            h = (h + 1) & mask;
+            --r->count;
+            --rc->n;
+        }
+        r->head = (int)h;
+    }
+}
 
-        int rw = 0;
-        for (int i = 0; i < rain.n; ++i) {
-            rain.v[i].y += rain.v[i].speed;
-            if ((int)rain.v[i].y < g_rows) {
-                rain.v[rw++] = rain.v[i];
-            }
+static void rcols_clear(RainCols *rc) {
+    if (rc->rings) memset(rc->rings, 0, (size_t)rc->ncols * sizeof(*rc->rings));
+    rc->n = 0;
+}
+
+static void rcols_free(RainCols *rc) {
+    heap_free(rc->drops);
+    heap_free(rc->rings);
+    memset(rc, 0, sizeof(*rc));
+}
+
+// --- lightning bolt ---
+// Index of the first segment born at or after `cutoff`, searched from a
+// cursor that is usually already there. The render time may trail the last
+// bolt_update() by up to a step, so the answer can also lie a little before.
+static int seg_first_born(const Bolt *b, int hint, double cutoff) {
+    int i = hint;
+    while (i > 0 && b->segs[i - 1].birth >= cutoff) --i;
+    while (i < b->seg_count && b->segs[i].birth < cutoff) ++i;
+    return i;
+}
+
+// Index of the first segment that has not appeared by time `t`.
+static int seg_first_unborn(const Bolt *b, int hint, double t) {
+    int i = hint;
+    while (i > 0 && b->segs[i - 1].birth > t) --i;
+    while (i < b->seg_count && b->segs[i].birth <= t) ++i;
+    return i;
+}
+
+// Lays out the whole bolt: a trunk that steps down one row per growth step,
+// sometimes splitting into branches that wander up to two columns, and forks
+// that split off sideways. Step k appears growth_delay * k after now, so how
+// fast a bolt grows does not depend on how often it is updated. Fails only
+// when every pool slot is taken by a live bolt.
+static bool bolt_create(Bolt *b, SegPool *pool, int start_row, int start_col, int max_y, int max_x,
+                        const FrameTime *ft, double growth_delay, Rng *rng) {
+    int slot = seg_pool_acquire(pool);
+    if (slot < 0) return false;
+    int min_len, max_len;
+    bolt_len_range(max_y, &min_len, &max_len);
+    int target_len = rng_below(rng, max_len - min_len + 1) + min_len;
+    b->slot = slot;
+    b->segs = pool->block + (size_t)slot * pool->slot_cap;
+    b->seg_head = 0; b->seg_count = 0; b->seg_cap = pool->slot_cap;
+    memset(b->step_head, 0, sizeof(b->step_head));
+    b->revealed = 1;
+    Segment first = { start_row, start_col, ft->now };
+    seg_push(b, first);
+
+    for (int step = 1;; ++step) {
+        Segment last = b->segs[b->seg_count - 1];
+        if (b->seg_count >= target_len || last.y >= max_y - 1) break;
+        double t = ft->now + step * growth_delay;
+
+        int branches = 1;
+        if (rng_chance(rng, LIGHTNING_BRANCH_CHANCE)) {
+            branches = rng_below(rng, LIGHTNING_MAX_BRANCHES + 1) + 1;
         }
-        rain.n = rw;
 
-        erase();
+        int current_x = last.x;
+        int primary_next_x = current_x;
 
-        for (int i = 0; i < bolts.n; ++i) bolt_draw(&bolts.v[i], light_attr);
+        for (int i = 0; i < branches; ++i) {
+            int offset = rng_below(rng, 5) - 2; // [-2,2]
+            int nx = current_x + offset;
+            if (nx < 0) nx = 0;
+            if (nx >= max_x) nx = max_x - 1;
+            int ny = last.y + 1;
+            if (ny >= max_y) ny = max_y - 1;
+            Segment s = { ny, nx, t };
+            seg_push(b, s);
+            if (i == 0) primary_next_x = nx;
+            current_x = nx;
+        }
 
-        for (int i = 0; i < rain.n; ++i) {
-            int y = (int)rain.v[i].y;
-            if (y >= 0 && y < g_rows && rain.v[i].x >= 0 && rain.v[i].x < g_cols) {
-                chtype attr = rain_attr;
-                if (thunder) attr |= A_BOLD;
-                else if (rain.v[i].speed < 0.8) attr |= A_DIM;
-                mvaddch(y, rain.v[i].x, rain.v[i].ch | attr);
+        if (rng_chance(rng, FORK_CHANCE)) {
+            int off = rng_below(rng, 2*FORK_HORIZONTAL_SPREAD + 1) - FORK_HORIZONTAL_SPREAD;
+            if (off == 0) off = rng_below(rng, 2) ? -1 : 1;
+            int fx = last.x + off;
+            if (fx < 0) fx = 0;
+            if (fx >= max_x) fx = max_x - 1;
+            int fy = last.y + 1;
+            if (fy >= max_y) fy = max_y - 1;
+            if (fx != primary_next_x) {
+                Segment s = { fy, fx, t };
+                seg_push(b, s);
             }
         }
+    }
+    return true;
+}
 
-        doupdate();
-        refresh();
+// Moves the reveal and fade cursors up to ft; no random numbers and no
+// geometry, so a frame costs the same however the bolt is shaped. The bolt
+// lives while the last segment of its path does.
+static bool bolt_update(Bolt *b, const FrameTime *ft) {
+    b->revealed = seg_first_unborn(b, b->revealed, ft->now);
+    b->seg_head = seg_first_born(b, b->seg_head, ft->fade_cutoff);
+    for (int k = 0; k < FADE_STEPS - 1; ++k) b->step_head[k] = seg_first_born(b, b->step_head[k], ft->step_cutoff[k]);
+    return b->segs[b->seg_count - 1].birth >= ft->fade_cutoff;
+}
+
+// Draws segments [from, to) youngest first; a cell already claimed in `zg`
+// (by a younger segment, or a bolt drawn later) keeps what it has.
+static void bolt_draw_tier(const Bolt *b, int from, int to, chtype ch, Canvas *cv, ZGrid *zg) {
+    for (int i = to - 1; i >= from; --i) {
+        int y = b->segs[i].y, x = b->segs[i].x;
+        if (y >= 0 && y < cv->rows && x >= 0 && x < cv->cols && zgrid_claim(zg, y * cv->cols + x, Z_BOLT))
+            canvas_put(cv, y, x, ch);
+    }
+}
+
+// Bolts sharing a grid must be drawn newest-first, as sim_render() does.
+// fade_attr[k] is the attribute of fade step k.
+static void bolt_draw(const Bolt *b, Canvas *cv, const FrameTime *ft, const chtype *fade_attr, ZGrid *zg) {
+    int to = seg_first_unborn(b, b->revealed, ft->now);
+    for (int k = 0; k < FADE_STEPS; ++k) {
+        int from = k < FADE_STEPS - 1 ? seg_first_born(b, b->step_head[k], ft->step_cutoff[k])
+                                      : seg_first_born(b, b->seg_head, ft->fade_cutoff);
+        if (from >= to) continue;
+        bolt_draw_tier(b, from, to, (chtype)(unsigned char)FADE_GLYPHS[k] | fade_attr[k], cv, zg);
+        to = from;
+    }
+}
+
+// --- worker pool ---
+// A fixed set of threads that all run the same function, one index each, and
+// meet again before pool_run() returns. The calling thread is worker 0.
+typedef void (*PoolFn)(void *ctx, int worker);
+
+typedef struct WorkerPool WorkerPool;
+
+typedef struct {
+    WorkerPool *pool;
+    int index;
+} PoolWorker;
+
+struct WorkerPool {
+    int n; // workers, including the caller
+    pthread_t *threads;
+    PoolWorker *workers;
+    pthread_mutex_t mu;
+    pthread_cond_t wake, done;
+    unsigned gen;
+    int busy;
+    bool stop;
+    PoolFn fn;
+    void *ctx;
+};
+
+// Helper threads keep every signal blocked so SIGWINCH and friends always
+// interrupt the main thread's wait in sched_wait().
+static bool thread_spawn(pthread_t *th, void *(*fn)(void*), void *arg) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    bool ok = pthread_create(th, NULL, fn, arg) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return ok;
+}
+
+static void *pool_thread(void *arg) {
+    PoolWorker *w = (PoolWorker*)arg;
+    WorkerPool *p = w->pool;
+    unsigned seen = 0;
+    pthread_mutex_lock(&p->mu);
+    for (;;) {
+        while (p->gen == seen && !p->stop) pthread_cond_wait(&p->wake, &p->mu);
+        if (p->stop) break;
+        seen = p->gen;
+        PoolFn fn = p->fn;
+        void *ctx = p->ctx;
+        pthread_mutex_unlock(&p->mu);
+        fn(ctx, w->index);
+        pthread_mutex_lock(&p->mu);
+        if (--p->busy == 0) pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->mu);
+    return NULL;
+}
+
+static void pool_destroy(WorkerPool *p);
+
+static WorkerPool *pool_create(int n) {
+    WorkerPool *p = (WorkerPool*)heap_calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    p->threads = (pthread_t*)heap_calloc(n, sizeof(*p->threads));
+    p->workers = (PoolWorker*)heap_calloc(n, sizeof(*p->workers));
+    pthread_mutex_init(&p->mu, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->done, NULL);
+    p->n = 1;
+    if (!p->threads || !p->workers) { pool_destroy(p); return NULL; }
+    for (int i = 1; i < n; ++i) {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        if (!thread_spawn(&p->threads[i], pool_thread, &p->workers[i])) break;
+        p->n = i + 1;
+    }
+    return p;
+}
+
+// Runs fn(ctx, i) for every worker i and waits for all of them.
+static void pool_run(WorkerPool *p, PoolFn fn, void *ctx) {
+    pthread_mutex_lock(&p->mu);
+    p->fn = fn;
+    p->ctx = ctx;
+    p->busy = p->n - 1;
+    ++p->gen;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->mu);
+
+    fn(ctx, 0);
+
+    pthread_mutex_lock(&p->mu);
+    while (p->busy > 0) pthread_cond_wait(&p->done, &p->mu);
+    pthread_mutex_unlock(&p->mu);
+}
+
+static void pool_destroy(WorkerPool *p) {
+    if (!p) return;
+    pthread_mutex_lock(&p->mu);
+    p->stop = true;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->mu);
+    for (int i = 1; i < p->n; ++i) pthread_join(p->threads[i], NULL);
+    pthread_mutex_destroy(&p->mu);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->done);
+    heap_free(p->threads);
+    heap_free(p->workers);
+    heap_free(p);
+}
+
+// --- simulation core ---
+// All state that evolves over time lives here; nothing in this section touches
+// ncurses, so the physics only depend on the sequence of sim_step() calls.
+//
+// Rain lives in column bands. Single-threaded there is one band covering the
+// grid; with --threads each worker owns one band and spawns, advances and
+// rasterizes its drops without touching anyone else's columns. A band is at
+// least one column wide: a grid narrower than the pool uses fewer bands. A band keeps
+// its drops in `rain` or, with the columns engine, in `colrain`.
+typedef struct {
+    int x0, x1;      // columns [x0, x1)
+    RainVec rain;
+    RainCols colrain;
+    Rng rng;
+    int spawn_n[MAX_STEPS_PER_FRAME]; // several bands: drops to place per step of a job
+    int *touched;    // rasterization output for canvas_merge()
+    int ntouched;
+    size_t touched_cap;
+    uint64_t hash;
+} RainBand;
+
+typedef struct {
+    int rows, cols;
+    bool thunder;
+    double density; // spawn multiplier (--density)
+    double lod;     // level of detail in [LOD_MIN, 1], lowered by --frame-budget-ms
+    float hide_below; // --max-bytes-per-sec: drops slower than this are not drawn
+    double t;       // simulation clock (seconds since start)
+    int rain_engine;
+    RainBand *bands;
+    int nbands;     // bands in use, at most one per column
+    int band_cap;   // bands allocated, one per pool worker; the rest stay empty
+    WorkerPool *pool; // NULL when single-threaded
+    bool owns_pool; // false when the pool is shared (see Panes)
+    int max_bolts;  // --max-bolts
+    double last_strike; // sim time of the newest bolt
+    BoltVec bolts;  // capacity max_bolts, reserved up front
+    SegPool seg_pool;
+    ZGrid zgrid;    // render scratch: who holds each cell this frame
+    Rng growth_rng, spawn_rng;
+    Rng rain_rng;   // several bands: the scene-wide rain spawns
+    DropTemplate templates[2][RAIN_TEMPLATES]; // [storm]
+    chtype looks[2][RAIN_LOOKS];              // [storm][look], shade pair offset only
+    bool shaded;    // looks and fade steps carry gradient pair offsets
+} Sim;
+
+// Band 0 keeps RNG_STREAM_RAIN so single-threaded runs match across builds.
+enum { RNG_STREAM_RAIN = 1, RNG_STREAM_GROWTH, RNG_STREAM_SPAWN, RNG_STREAM_TEMPLATES,
+       RNG_STREAM_RAIN_SPAWN, RNG_STREAM_BAND = 0x100 };
+
+// A drop's look is (glyph * 2 + slow) * RAIN_SHADES + shade; slow drops are
+// dimmed unless it storms, when every drop is bold. The shade follows the
+// speed, so faster (nearer) drops come out brighter once sim_set_shaded() has
+// put the shade pairs into the looks.
+static void sim_build_looks(Sim *s) {
+    for (int look = 0; look < RAIN_LOOKS; ++look) {
+        chtype ch = (chtype)(unsigned char)RAIN_CHARS[look / (2 * RAIN_SHADES)];
+        chtype pair = s->shaded ? COLOR_PAIR(CP_RAIN_SHADE + look % RAIN_SHADES) : 0;
+        s->looks[0][look] = ch | pair | (look / RAIN_SHADES & 1 ? A_DIM : 0);
+        s->looks[1][look] = ch | pair | A_BOLD;
+    }
+}
+
+// With `on`, looks and fade steps carry their own color pairs: the caller's
+// rain and lightning attributes must then carry none, as term_setup_colors()
+// hands out for a gradient.
+static void sim_set_shaded(Sim *s, bool on) {
+    s->shaded = on;
+    sim_build_looks(s);
+}
+
+// Spawning draws speeds and looks from a fixed table per weather, stratified
+// over the speed range, so a new drop costs one random number for its column
+// and template.
+static void sim_build_templates(Sim *s, uint64_t seed) {
+    Rng rng;
+    rng_seed(&rng, seed, RNG_STREAM_TEMPLATES);
+    sim_build_looks(s);
+    for (int storm = 0; storm < 2; ++storm) {
+        double max_speed = storm ? RAIN_MAX_SPEED_STORM : RAIN_MAX_SPEED;
+        for (int k = 0; k < RAIN_TEMPLATES; ++k) {
+            DropTemplate *t = &s->templates[storm][k];
+            t->speed = (float)(RAIN_MIN_SPEED + (k + rng_unit(&rng)) / RAIN_TEMPLATES * (max_speed - RAIN_MIN_SPEED));
+            int shade = (int)((t->speed - RAIN_MIN_SPEED) / (RAIN_MAX_SPEED_STORM - RAIN_MIN_SPEED) * RAIN_SHADES);
+            if (shade >= RAIN_SHADES) shade = RAIN_SHADES - 1;
+            int glyph = rng_below(&rng, RAIN_LOOKS / (2 * RAIN_SHADES));
+            t->look = (unsigned char)((glyph * 2 + (t->speed < RAIN_DIM_SPEED)) * RAIN_SHADES + shade);
+        }
+    }
+}
+
+// Bands past nbands get no columns, so their drops (after a resize) move on.
+static bool sim_layout_bands(Sim *s) {
+    s->nbands = s->band_cap < s->cols ? s->band_cap : s->cols;
+    for (int i = s->nbands; i < s->band_cap; ++i) s->bands[i].x0 = s->bands[i].x1 = s->cols;
+    for (int i = 0; i < s->nbands; ++i) {
+        RainBand *b = &s->bands[i];
+        b->x0 = (int)((long)s->cols * i / s->nbands);
+        b->x1 = (int)((long)s->cols * (i + 1) / s->nbands);
+        size_t need = (size_t)s->rows * (b->x1 - b->x0 + 1);
+        if (s->nbands > 1 && need > b->touched_cap) {
+            int *t = (int*)heap_realloc(b->touched, need * sizeof(*t));
+            if (!t) return false;
+            b->touched = t;
+            b->touched_cap = need;
+        }
+    }
+    return true;
+}
+
+// One band per worker of `pool` (but no more than columns), which may be
+// shared with other simulations driven from the same thread, or a single band
+// when NULL.
+static bool sim_init_on(Sim *s, int rows, int cols, uint64_t seed, WorkerPool *pool, int rain_engine) {
+    memset(s, 0, sizeof(*s));
+    s->rows = rows;
+    s->cols = cols;
+    s->rain_engine = rain_engine;
+    s->density = 1.0;
+    s->lod = 1.0;
+    rng_seed(&s->growth_rng, seed, RNG_STREAM_GROWTH);
+    rng_seed(&s->spawn_rng, seed, RNG_STREAM_SPAWN);
+    rng_seed(&s->rain_rng, seed, RNG_STREAM_RAIN_SPAWN);
+    sim_build_templates(s, seed);
+    s->bolts.v = (Bolt*)heap_alloc(MAX_BOLTS * sizeof(*s->bolts.v));
+    s->bolts.cap = MAX_BOLTS;
+    s->max_bolts = MAX_BOLTS;
+    s->last_strike = -FLASH_TIME;
+    s->pool = pool;
+    s->band_cap = pool ? pool->n : 1;
+    s->bands = (RainBand*)heap_calloc(s->band_cap, sizeof(*s->bands));
+    if (!s->bands) return false;
+    for (int i = 0; i < s->band_cap; ++i)
+        rng_seed(&s->bands[i].rng, seed, i ? RNG_STREAM_BAND + i : RNG_STREAM_RAIN);
+    if (!s->bolts.v || !seg_pool_reserve(&s->seg_pool, MAX_BOLTS, rows) || !sim_layout_bands(s) ||
+        !zgrid_reserve(&s->zgrid, (size_t)rows * cols))
+        return false;
+    if (rain_engine == RAIN_ENGINE_COLUMNS) {
+        for (int i = 0; i < s->band_cap; ++i) {
+            RainBand *b = &s->bands[i];
+            if (!rcols_layout(&b->colrain, b->x0, b->x1 - b->x0)) return false;
+        }
+    }
+    return true;
+}
+
+static bool sim_init(Sim *s, int rows, int cols, uint64_t seed, int threads, int rain_engine) {
+    WorkerPool *pool = NULL;
+    if (threads > 1 && !(pool = pool_create(threads))) {
+        memset(s, 0, sizeof(*s));
+        return false;
+    }
+    bool ok = sim_init_on(s, rows, cols, seed, pool, rain_engine);
+    s->owns_pool = pool != NULL;
+    return ok;
+}
+
+static void sim_clear(Sim *s) {
+    for (int i = 0; i < s->band_cap; ++i) {
+        s->bands[i].rain.n = 0;
+        rcols_clear(&s->bands[i].colrain);
+    }
+    for (int i = 0; i < s->bolts.n; ++i) seg_pool_release(&s->seg_pool, s->bolts.v[i].slot);
+    s->bolts.n = 0;
+}
+
+static inline int scale_coord(int v, int from, int to) {
+    return (int)((long)v * to / from);
+}
+
+static int sim_drop_count(const Sim *s) {
+    int n = 0;
+    for (int i = 0; i < s->band_cap; ++i) n += s->bands[i].rain.n + s->bands[i].colrain.n;
+    return n;
+}
+
+// The columns engine collects every drop first, since its rings are laid
+// out for the old band widths. Without memory for that the sky starts over.
+static void sim_reflow_columns(Sim *s, int old_rows, int old_cols) {
+    int n = sim_drop_count(s);
+    Raindrop *all = (Raindrop*)heap_alloc((size_t)(n ? n : 1) * sizeof(*all));
+    int k = 0;
+    for (int i = 0; all && i < s->band_cap; ++i) {
+        RainCols *rc = &s->bands[i].colrain;
+        for (int c = 0; c < rc->ncols; ++c)
+            for (int j = 0; j < rc->rings[c].count; ++j) {
+                const ColDrop *d = RCOL_AT(rc, c, j);
+                all[k++] = (Raindrop){ rc->x0 + c, d->y, d->speed, d->look };
+            }
+    }
+    float fy = (float)s->rows / (float)old_rows;
+    bool ok = true;
+    for (int i = 0; i < s->band_cap; ++i) {
+        RainBand *b = &s->bands[i];
+        ok = rcols_layout(&b->colrain, b->x0, b->x1 - b->x0) && ok;
+    }
+    for (int j = 0; ok && j < k; ++j) {
+        int x = scale_coord(all[j].x, old_cols, s->cols);
+        int b = (int)((long)x * s->nbands / s->cols);
+        while (b > 0 && x < s->bands[b].x0) --b;
+        while (b < s->nbands - 1 && x >= s->bands[b].x1) ++b;
+        RainCols *rc = &s->bands[b].colrain;
+        rcols_insert(rc, x - rc->x0, all[j].y * fy, all[j].speed, all[j].look, s->rows);
+    }
+    heap_free(all);
+}
+
+// Moves every drop to the same relative spot in the new geometry, then hands
+// drops whose column now lies in another band over to it.
+static void sim_reflow_rain(Sim *s, int old_rows, int old_cols) {
+    if (s->rain_engine == RAIN_ENGINE_COLUMNS) {
+        sim_reflow_columns(s, old_rows, old_cols);
+        return;
+    }
+    float fy = (float)s->rows / (float)old_rows;
+    for (int i = 0; i < s->band_cap; ++i) {
+        RainVec *rv = &s->bands[i].rain;
+        for (int k = 0; k < rv->n; ++k) {
+            rv->x[k] = scale_coord(rv->x[k], old_cols, s->cols);
+            rv->y[k] *= fy;
+        }
+    }
+    if (s->band_cap == 1) return;
+    for (int i = 0; i < s->band_cap; ++i) {
+        RainBand *b = &s->bands[i];
+        RainVec *rv = &b->rain;
+        int w = 0;
+        for (int k = 0; k < rv->n; ++k) {
+            int x = rv->x[k];
+            if (x >= b->x0 && x < b->x1) {
+                rv->x[w] = x; rv->y[w] = rv->y[k]; rv->speed[w] = rv->speed[k]; rv->look[w] = rv->look[k];
+                ++w;
+                continue;
+            }
+            int j = (int)((long)x * s->nbands / s->cols);
+            while (j > 0 && x < s->bands[j].x0) --j;
+            while (j < s->nbands - 1 && x >= s->bands[j].x1) ++j;
+            Raindrop d = { x, rv->y[k], rv->speed[k], rv->look[k] };
+            rain_push(&s->bands[j].rain, d);
+        }
+        rv->n = w;
+    }
+}
+
+// Same for bolts: whole paths, revealed or not, are rescaled in place.
+static void sim_reflow_bolts(Sim *s, int old_rows, int old_cols) {
+    for (int i = 0; i < s->bolts.n; ++i) {
+        Bolt *b = &s->bolts.v[i];
+        b->segs = s->seg_pool.block + (size_t)b->slot * s->seg_pool.slot_cap;
+        b->seg_cap = s->seg_pool.slot_cap;
+        for (int k = 0; k < b->seg_count; ++k) {
+            b->segs[k].y = scale_coord(b->segs[k].y, old_rows, s->rows);
+            b->segs[k].x = scale_coord(b->segs[k].x, old_cols, s->cols);
+        }
+    }
+}
+
+// Keeps the sky as it was, stretched or squeezed to the new size; buffers
+// are only reallocated when they need to grow.
+static bool sim_resize(Sim *s, int rows, int cols) {
+    int old_rows = s->rows, old_cols = s->cols;
+    s->rows = rows;
+    s->cols = cols;
+    if (!seg_pool_regrow(&s->seg_pool, rows) || !sim_layout_bands(s) ||
+        !zgrid_reserve(&s->zgrid, (size_t)rows * cols))
+        return false;
+    sim_reflow_rain(s, old_rows, old_cols);
+    sim_reflow_bolts(s, old_rows, old_cols);
+    return true;
+}
+
+// --max-bolts: room for `n` concurrent bolts instead of MAX_BOLTS. Strikes
+// come proportionally more often, so the limit sets how wild a storm gets.
+// Live bolts are dropped.
+static bool sim_set_bolt_limit(Sim *s, int n) {
+    for (int i = 0; i < s->bolts.n; ++i) seg_pool_release(&s->seg_pool, s->bolts.v[i].slot);
+    s->bolts.n = 0;
+    Bolt *v = (Bolt*)heap_realloc(s->bolts.v, n * sizeof(*v));
+    if (!v) return false;
+    s->bolts.v = v;
+    s->bolts.cap = n;
+    s->max_bolts = n;
+    return seg_pool_reserve(&s->seg_pool, n, s->rows);
+}
+
+static void sim_free(Sim *s) {
+    if (s->bands) sim_clear(s);
+    if (s->owns_pool) pool_destroy(s->pool);
+    heap_free(s->bolts.v);
+    seg_pool_free(&s->seg_pool);
+    zgrid_free(&s->zgrid);
+    for (int i = 0; i < s->band_cap; ++i) {
+        rain_free(&s->bands[i].rain);
+        rcols_free(&s->bands[i].colrain);
+        heap_free(s->bands[i].touched);
+    }
+    heap_free(s->bands);
+    memset(s, 0, sizeof(*s));
+}
+
+// Heap bytes of the rain storage itself.
+static size_t sim_rain_bytes(const Sim *s) {
+    size_t n = 0;
+    for (int i = 0; i < s->band_cap; ++i) {
+        const RainCols *rc = &s->bands[i].colrain;
+        n += (size_t)s->bands[i].rain.cap * RAIN_DROP_BYTES;
+        if (rc->drops) n += (size_t)rc->ncols * (rc->cap * sizeof(ColDrop) + sizeof(ColRing));
+    }
+    return n;
+}
+
+// Caps the rain at `avail` bytes, split between bands by width; see panes_bound().
+static bool sim_bound_rain(Sim *s, size_t avail) {
+    for (int i = 0; i < s->band_cap; ++i) {
+        RainBand *b = &s->bands[i];
+        int width = b->x1 - b->x0;
+        size_t share = avail / (size_t)s->cols * (size_t)width;
+        if (s->rain_engine == RAIN_ENGINE_COLUMNS) {
+            RainCols *rc = &b->colrain;
+            size_t per_col = width ? share / (size_t)width : 0;
+            size_t slots = per_col > sizeof(ColRing) ? (per_col - sizeof(ColRing)) / sizeof(ColDrop) : 0;
+            int cap = 1;
+            while (cap <= INT_MAX / 2 && (size_t)cap * 2 <= slots) cap *= 2;
+            rc->fixed = true;
+            if (cap != rc->cap && !rcols_set_cap(rc, cap)) return false;
+        } else {
+            RainVec *rv = &b->rain;
+            size_t n = share / RAIN_DROP_BYTES;
+            int cap = n < 1 ? 1 : n > INT_MAX ? INT_MAX : (int)n;
+            rv->limit = cap;
+            if (cap != rv->cap && !rain_set_cap(rv, cap)) return false;
+        }
+    }
+    return true;
+}
+
+// --low-power: the longest frame interval that still moves every drop by at
+// least a row per frame, i.e. one row of the slowest drop. Lightning needs
+// the normal rate; an empty sky only has to notice the next drop.
+static double sim_idle_interval(const Sim *s) {
+    if (s->thunder || s->bolts.n > 0) return 0.0;
+    float slowest = 0.0f;
+    for (int i = 0; i < s->nbands; ++i) {
+        const RainVec *rv = &s->bands[i].rain;
+        for (int k = 0; k < rv->n; ++k)
+            if (slowest == 0.0f || rv->speed[k] < slowest) slowest = rv->speed[k];
+        const RainCols *rc = &s->bands[i].colrain;
+        for (int c = 0; c < rc->ncols; ++c)
+            for (int k = 0; k < rc->rings[c].count; ++k) {
+                float v = RCOL_AT(rc, c, k)->speed;
+                if (slowest == 0.0f || v < slowest) slowest = v;
+            }
+    }
+    double dt = slowest > 0.0f ? 1.0 / slowest : LOW_POWER_MAX_INTERVAL;
+    return dt < LOW_POWER_MAX_INTERVAL ? dt : LOW_POWER_MAX_INTERVAL;
+}
+
+// The phases of one step, in order. They are separate so --bench can time
+// each one; everything else goes through sim_step().
+// --flash: what the sky does behind the bolts. While any bolt is on screen
+// the background is brightened, and for FLASH_TIME after each strike the
+// whole screen is reversed. Both are terminal-wide settings (term_sky()), so
+// a flash costs a few bytes rather than a rewrite of every cell.
+enum { SKY_GLOW = 1, SKY_FLASH = 2 };
+
+static int sim_sky(const Sim *s) {
+    int sky = s->bolts.n > 0 ? SKY_GLOW : 0;
+    if (s->t - s->last_strike < FLASH_TIME) sky |= SKY_FLASH;
+    return sky;
+}
+
+// Speed below which drops are the slower half of the dim ones, which
+// --max-bytes-per-sec stops drawing first. Outside a storm every drop is dim.
+static float sim_thin_speed(const Sim *s) {
+    double top = s->thunder ? RAIN_DIM_SPEED : RAIN_MAX_SPEED;
+    return (float)((RAIN_MIN_SPEED + top) / 2);
+}
+
+// What the level of detail leaves of the bolt cap and growth rate; at full
+// detail these are the bolt limit and LIGHTNING_GROWTH_DELAY.
+static int sim_bolt_cap(const Sim *s) {
+    int cap = (int)(s->max_bolts * s->lod + 0.5);
+    return cap < 1 ? 1 : cap;
+}
+
+static double sim_growth_delay(const Sim *s) {
+    return LIGHTNING_GROWTH_DELAY + (1.0 - s->lod) / (1.0 - LOD_MIN) * LIGHTNING_GROWTH_DELAY_LOD;
+}
+
+static void sim_spawn_bolts(Sim *s, const FrameTime *ft) {
+    double chance = LIGHTNING_CHANCE * ((double)s->max_bolts / MAX_BOLTS);
+    if (s->thunder && s->bolts.n < sim_bolt_cap(s) && rng_chance(&s->spawn_rng, chance)) {
+        int start_col = (s->cols/4) + rng_below(&s->spawn_rng, s->cols/2);
+        int start_row = rng_below(&s->spawn_rng, (s->rows > 5) ? (s->rows/5) : s->rows);
+        Bolt b;
+        if (!bolt_create(&b, &s->seg_pool, start_row, start_col, s->rows, s->cols, ft,
+                         sim_growth_delay(s), &s->growth_rng))
+            return;
+        if (boltvec_push(&s->bolts, b)) s->last_strike = ft->now;
+        else seg_pool_release(&s->seg_pool, b.slot);
+    }
+}
+
+static void sim_update_bolts(Sim *s, const FrameTime *ft) {
+    int w = 0;
+    for (int i = 0; i < s->bolts.n; ++i) {
+        if (bolt_update(&s->bolts.v[i], ft)) {
+            s->bolts.v[w++] = s->bolts.v[i];
+        } else {
+            seg_pool_release(&s->seg_pool, s->bolts.v[i].slot);
+        }
+    }
+    s->bolts.n = w;
+}
+
+// Drops one step adds to the whole scene: one roll of the spawn chance, then
+// up to what the width allows. It does not depend on how the scene is banded.
+static int sim_spawn_count(const Sim *s, Rng *rng) {
+    double gen_chance = s->thunder ? RAIN_CHANCE_STORM : RAIN_CHANCE;
+    int per_drop = s->thunder ? RAIN_COLS_PER_DROP_STORM : RAIN_COLS_PER_DROP;
+    int max_new = (int)((double)(s->cols / per_drop) * s->density * s->lod);
+    if (!rng_chance(rng, gen_chance)) return 0;
+    return 1 + (max_new > 1 ? rng_below(rng, max_new) : 0);
+}
+
+// With several bands the main thread decides each step's spawns up front and
+// deals them out by width: band i gets the drops whose evenly spaced, randomly
+// offset slots fall into its columns, so shares add up to the total and each
+// band's expectation is proportional to its width.
+static void sim_deal_spawns(Sim *s, int steps) {
+    for (int k = 0; k < steps; ++k) {
+        int n = sim_spawn_count(s, &s->rain_rng);
+        double u = n ? rng_unit(&s->rain_rng) : 0.0;
+        for (int i = 0; i < s->nbands; ++i) {
+            RainBand *b = &s->bands[i];
+            b->spawn_n[k] = (int)((double)n * b->x1 / s->cols + u) - (int)((double)n * b->x0 / s->cols + u);
+        }
+    }
+}
+
+// Places `n_new` drops in the band's columns.
+static void band_spawn(const Sim *s, RainBand *b, int n_new) {
+    int width = b->x1 - b->x0;
+    Rng *rng = &b->rng;
+    if (width < 1 || n_new < 1) return;
+    const DropTemplate *tpl = s->templates[s->thunder];
+    uint64_t w = (uint64_t)width;
+    if (s->rain_engine == RAIN_ENGINE_COLUMNS) {
+        for (int i = 0; i < n_new; ++i) {
+            uint64_t r = rng_next(rng);
+            const DropTemplate *t = &tpl[r & (RAIN_TEMPLATES - 1)];
+            rcols_insert(&b->colrain, (int)(((r >> 32) * w) >> 32), 0.0f, t->speed, t->look, s->rows);
+        }
+        return;
+    }
+    RainVec *rv = &b->rain;
+    if (!rain_reserve(rv, rv->n + n_new)) n_new = rv->cap - rv->n; // the rest is dropped
+    for (int k = rv->n; k < rv->n + n_new; ++k) {
+        uint64_t r = rng_next(rng);
+        const DropTemplate *t = &tpl[r & (RAIN_TEMPLATES - 1)];
+        rv->x[k] = b->x0 + (int)(((r >> 32) * w) >> 32);
+        rv->y[k] = 0.0f;
+        rv->speed[k] = t->speed;
+        rv->look[k] = t->look;
+    }
+    rv->n += n_new;
+}
+
+// Draws a band's drops, newest first so the newest of several in a cell is
+// the one shown; banded canvases collect into the band's own list. Bands
+// cover disjoint columns, so they share the z-grid without locking.
+static void band_draw(Sim *s, RainBand *b, Canvas *cv, float lag, chtype rain_attr) {
+    const RainVec *rv = &b->rain;
+    const chtype *looks = s->looks[s->thunder];
+    float cut = s->hide_below;
+    bool local = s->nbands > 1;
+    b->ntouched = 0;
+    b->hash = 0;
+    if (s->rain_engine == RAIN_ENGINE_COLUMNS) {
+        // One column at a time, latest to leave first.
+        const RainCols *rc = &b->colrain;
+        unsigned mask = (unsigned)rc->cap - 1;
+        for (int c = 0; c < rc->ncols; ++c) {
+            int x = rc->x0 + c;
+            if (x >= cv->cols) break;
+            const ColDrop *ring = rc->drops + (size_t)c * rc->cap;
+            unsigned h = (unsigned)rc->rings[c].head;
+            for (int k = rc->rings[c].count - 1; k >= 0; --k) {
+                const ColDrop *d = &ring[(h + (unsigned)k) & mask];
+                if (d->speed < cut) continue;
+                int y = (int)(d->y - d->speed * lag);
+                if (y < 0 || y >= cv->rows || !zgrid_claim(&s->zgrid, y * cv->cols + x, Z_RAIN)) continue;
+                chtype ch = looks[d->look] | rain_attr;
+                if (local) canvas_put_local(cv, y, x, ch, b->touched, &b->ntouched, &b->hash);
+                else canvas_put(cv, y, x, ch);
+            }
+        }
+        return;
+    }
+    for (int i = rv->n - 1; i >= 0; --i) {
+        if (rv->speed[i] < cut) continue;
+        int y = (int)(rv->y[i] - rv->speed[i] * lag);
+        int x = rv->x[i];
+        if (y >= 0 && y < cv->rows && x >= 0 && x < cv->cols && zgrid_claim(&s->zgrid, y * cv->cols + x, Z_RAIN)) {
+            chtype ch = looks[rv->look[i]] | rain_attr;
+            if (local) canvas_put_local(cv, y, x, ch, b->touched, &b->ntouched, &b->hash);
+            else canvas_put(cv, y, x, ch);
+        }
+    }
+}
+
+// Work handed to every band: `steps` rounds of spawn and/or advance by dt,
+// then, if cv is set, rasterization at the given interpolation lag.
+typedef struct {
+    Sim *s;
+    int steps;
+    bool spawn, advance;
+    double dt;
+    Canvas *cv;
+    float lag;
+    chtype rain_attr;
+} RainJob;
+
+static void rain_job_band(const RainJob *j, RainBand *b) {
+    for (int k = 0; k < j->steps; ++k) {
+        if (j->spawn) band_spawn(j->s, b, j->s->nbands > 1 ? b->spawn_n[k] : sim_spawn_count(j->s, &b->rng));
+        if (j->advance) {
+            if (j->s->rain_engine == RAIN_ENGINE_COLUMNS) rcols_advance(&b->colrain, (float)j->dt, j->s->rows);
+            else rain_advance(&b->rain, (float)j->dt, j->s->rows);
+        }
+    }
+    if (j->cv) band_draw(j->s, b, j->cv, j->lag, j->rain_attr);
+}
+
+static void rain_job_worker(void *ctx, int worker) {
+    const RainJob *j = (const RainJob*)ctx;
+    for (int i = worker; i < j->s->nbands; i += j->s->pool->n) rain_job_band(j, &j->s->bands[i]);
+}
+
+static void sim_run_rain(Sim *s, RainJob *j) {
+    if (j->spawn && s->nbands > 1) sim_deal_spawns(s, j->steps);
+    if (s->pool) pool_run(s->pool, rain_job_worker, j);
+    else rain_job_band(j, &s->bands[0]);
+}
+
+static void sim_spawn_rain(Sim *s) {
+    RainJob j = { .s = s, .steps = 1, .spawn = true };
+    sim_run_rain(s, &j);
+}
+
+static void sim_advance_rain(Sim *s, double dt) {
+    RainJob j = { .s = s, .steps = 1, .advance = true, .dt = dt };
+    sim_run_rain(s, &j);
+}
+
+// Bolt half of a step; rain is independent of bolts, so it can be batched.
+static void sim_step_bolts(Sim *s, double dt) {
+    s->t += dt;
+    FrameTime ft = frame_time_at(s->t);
+    sim_spawn_bolts(s, &ft);
+    sim_update_bolts(s, &ft);
+}
+
+// Advance the world by dt seconds. Spawn chances are per step, so callers
+// drive this with the fixed SIM_DT rather than the measured frame time.
+static void sim_step(Sim *s, double dt) {
+    sim_step_bolts(s, dt);
+    RainJob j = { .s = s, .steps = 1, .spawn = true, .advance = true, .dt = dt };
+    sim_run_rain(s, &j);
+}
+
+// Feeds `elapsed` seconds of frame time into the fixed-step accumulator `acc`
+// and returns the interpolation factor for rendering the result. All rain
+// steps of the frame go to the bands in one batch.
+static double sim_advance(Sim *s, double elapsed, double *acc) {
+    *acc += elapsed;
+    int steps = 0;
+    while (*acc >= SIM_DT && steps < MAX_STEPS_PER_FRAME) {
+        sim_step_bolts(s, SIM_DT);
+        *acc -= SIM_DT;
+        ++steps;
+    }
+    if (steps) {
+        RainJob j = { .s = s, .steps = steps, .spawn = true, .advance = true, .dt = SIM_DT };
+        sim_run_rain(s, &j);
+    }
+    // Under load, drop whole steps rather than letting the backlog grow.
+    if (*acc >= SIM_DT) *acc -= (double)(long)(*acc / SIM_DT) * SIM_DT;
+    return *acc / SIM_DT;
+}
+
+// --- rendering ---
+// alpha in [0,1) is how far the wall clock has progressed into the next
+// simulation step; positions are interpolated back from the current state.
+// Lightning attributes per fade step, newest first.
+static void sim_fade_attrs(const Sim *s, chtype light_attr, chtype fade[FADE_STEPS]) {
+    for (int k = 0; k < FADE_STEPS; ++k) fade[k] = light_attr | (s->shaded ? COLOR_PAIR(CP_FADE_STEP + k) : 0);
+}
+
+// Every layer claims its cells in the z-grid before drawing, so lightning
+// covers rain and no cell is drawn twice. Banded output is merged in band
+// order so the frame is the same on every run.
+static void sim_render(Sim *s, Canvas *cv, double alpha, chtype rain_attr, chtype light_attr) {
+    double lag = (1.0 - alpha) * SIM_DT;
+
+    canvas_clear(cv);
+
+    FrameTime ft = frame_time_at(s->t - lag);
+    chtype fade[FADE_STEPS];
+    sim_fade_attrs(s, light_attr, fade);
+    zgrid_reset(&s->zgrid);
+    for (int i = s->bolts.n - 1; i >= 0; --i) bolt_draw(&s->bolts.v[i], cv, &ft, fade, &s->zgrid);
+
+    RainJob j = { .s = s, .cv = cv, .lag = (float)lag, .rain_attr = rain_attr };
+    sim_run_rain(s, &j);
+    if (s->nbands > 1) {
+        for (int i = 0; i < s->nbands; ++i)
+            canvas_merge(cv, s->bands[i].touched, s->bands[i].ntouched, s->bands[i].hash);
+    }
+}
+
+// --- panes ---
+// A pane is one instance of the animation: a simulation of its own, the
+// fixed-step clock feeding it and the columns of the screen it covers.
+// --panes N lays out N of them side by side, a blank column apart, all driven
+// from one scheduler, frame clock and worker pool (pool_run() is only ever
+// called from the main thread, one simulation after the other). Pane 0 keeps
+// --seed and the others derive theirs from it, so a single pane matches the
+// plain program. With several panes each draws into a frame buffer of its
+// own, whose cells are then copied onto the screen canvas.
+typedef struct {
+    Sim sim;
+    Canvas canvas;  // several panes only; see canvas_init_frame()
+    int x0, cols;   // screen columns [x0, x0 + cols), clipped to the screen
+    double acc;     // frame time not yet consumed by sim_step()
+    double alpha;   // interpolation factor of the frame being drawn
+} Pane;
+
+typedef struct {
+    Pane *v;
+    int n;
+    int rows, cols;   // the whole screen
+    WorkerPool *pool; // shared by every pane's bands; NULL when single-threaded
+} Panes;
+
+#define MAX_PANES 16
+
+static uint64_t pane_seed(uint64_t seed, int k) {
+    uint64_t x = seed ^ ((uint64_t)k * 0xd1b54a32d192ed03ULL);
+    return k ? splitmix64(&x) : seed;
+}
+
+// Splits the screen's columns evenly; panes keep at least one column each.
+static void panes_layout(Panes *ps, int rows, int cols) {
+    ps->rows = rows;
+    ps->cols = cols;
+    for (int k = 0; k < ps->n; ++k) {
+        Pane *p = &ps->v[k];
+        p->x0 = (int)((long)(cols + 1) * k / ps->n);
+        int end = (int)((long)(cols + 1) * (k + 1) / ps->n) - 1;
+        p->cols = end > p->x0 ? end - p->x0 : 1;
+    }
+}
+
+static void panes_free(Panes *ps) {
+    for (int k = 0; k < ps->n; ++k) {
+        sim_free(&ps->v[k].sim);
+        canvas_free(&ps->v[k].canvas);
+    }
+    heap_free(ps->v);
+    pool_destroy(ps->pool);
+    memset(ps, 0, sizeof(*ps));
+}
+
+// On failure the panes still need panes_free().
+static bool panes_init(Panes *ps, int n, int rows, int cols, uint64_t seed, int threads, int rain_engine) {
+    memset(ps, 0, sizeof(*ps));
+    ps->v = (Pane*)heap_calloc(n, sizeof(*ps->v));
+    if (!ps->v) return false;
+    ps->n = n;
+    if (threads > 1 && !(ps->pool = pool_create(threads))) return false;
+    panes_layout(ps, rows, cols);
+    for (int k = 0; k < n; ++k) {
+        Pane *p = &ps->v[k];
+        if (!sim_init_on(&p->sim, rows, p->cols, pane_seed(seed, k), ps->pool, rain_engine)) return false;
+        if (n > 1 && !canvas_init_frame(&p->canvas, rows, p->cols)) return false;
+    }
+    return true;
+}
+
+static bool panes_resize(Panes *ps, int rows, int cols) {
+    panes_layout(ps, rows, cols);
+    for (int k = 0; k < ps->n; ++k) {
+        Pane *p = &ps->v[k];
+        if (!sim_resize(&p->sim, rows, p->cols)) return false;
+        if (ps->n > 1 && !canvas_resize(&p->canvas, rows, p->cols)) return false;
+    }
+    return true;
+}
+
+static size_t panes_rain_bytes(const Panes *ps) {
+    size_t n = 0;
+    for (int k = 0; k < ps->n; ++k) n += sim_rain_bytes(&ps->v[k].sim);
+    return n;
+}
+
+// --max-memory: gives the rain whatever `budget` leaves beside the rest of
+// our heap, split between the panes by width, and allocates all of it now so
+// spawning past the cap drops drops instead of allocating. Call once every
+// other buffer is in place, and again after each resize. False when the rest
+// alone does not fit.
+static bool panes_bound(Panes *ps, size_t budget) {
+    size_t other = atomic_load(&g_heap_bytes) - panes_rain_bytes(ps);
+    if (other >= budget) return false;
+    size_t avail = budget - other;
+    int width = 0;
+    for (int k = 0; k < ps->n; ++k) width += ps->v[k].cols;
+    for (int k = 0; k < ps->n; ++k) {
+        Pane *p = &ps->v[k];
+        if (!sim_bound_rain(&p->sim, ps->n == 1 ? avail : avail / (size_t)width * (size_t)p->cols)) return false;
+    }
+    return true;
+}
+
+static int panes_drop_count(const Panes *ps) {
+    int n = 0;
+    for (int k = 0; k < ps->n; ++k) n += sim_drop_count(&ps->v[k].sim);
+    return n;
+}
+
+static void panes_advance(Panes *ps, double elapsed) {
+    for (int k = 0; k < ps->n; ++k) ps->v[k].alpha = sim_advance(&ps->v[k].sim, elapsed, &ps->v[k].acc);
+}
+
+// Copies what `src` drew this frame onto `dst`, its left edge at column x0.
+static void canvas_blit(Canvas *dst, const Canvas *src, int x0) {
+    for (int k = 0; k < src->ntouched; ++k) {
+        int i = src->touched[k], y = i / src->cols, x = x0 + i % src->cols;
+        if (y < dst->rows && x < dst->cols) canvas_put(dst, y, x, src->cells[i]);
+    }
+}
+
+static void panes_render(Panes *ps, Canvas *cv, chtype rain_attr, chtype light_attr) {
+    if (ps->n == 1) {
+        sim_render(&ps->v[0].sim, cv, ps->v[0].alpha, rain_attr, light_attr);
+        return;
+    }
+    canvas_clear(cv);
+    for (int k = 0; k < ps->n; ++k) {
+        Pane *p = &ps->v[k];
+        sim_render(&p->sim, &p->canvas, p->alpha, rain_attr, light_attr);
+        canvas_blit(cv, &p->canvas, p->x0);
+    }
+}
+
+// --- frame scheduler ---
+// Frames are due at absolute CLOCK_MONOTONIC deadlines one interval apart, so
+// pacing does not drift with render time. Between deadlines we block in
+// ppoll() on stdin, which also sleeps out the sub-millisecond remainder.
+// The interval backs off by powers of two while frames come out identical
+// (idle) or while the tty's output queue is not draining. While paused no
+// frame is due at all and only input or a signal ends the wait.
+//
+// After sched_block_signals() the signals the loop reacts to are blocked
+// except inside the wait, which unblocks them atomically: one that arrives
+// after the loop has checked its flags stays pending and ends the next wait
+// at once, instead of going unnoticed until a deadline (or for good, while
+// paused). The one exception is writing a frame, see sched_output().
+#define SCHED_MAX_BACKOFF 5     // at most 32x the base interval
+#define SCHED_IDLE_FRAMES 30    // identical frames before slowing down
+#define SCHED_OUTQ_HIGH   4096  // bytes still queued on the tty after a frame
+#define SCHED_DRAIN_FRAMES 30   // frames with an empty queue before speeding up
+
+enum { SCHED_FRAME, SCHED_INPUT, SCHED_SIGNAL };
+
+typedef struct {
+    double base_interval; // from --fps
+    double interval;      // base_interval << backoff
+    double deadline;      // when the next frame is due
+    double min_interval;  // --low-power: floor the scene allows, else 0
+    bool poll_stdin;      // false once stdin hangs up
+    bool paused;
+    int idle_shift, idle_frames;
+    int out_shift, drained_frames;
+    sigset_t wait_mask;   // signal mask while waiting
+    sigset_t tty_signals; // the ones the tty sends, let in while writing
+} FrameSched;
+
+static void sched_init(FrameSched *fs, double fps) {
+    memset(fs, 0, sizeof(*fs));
+    fs->base_interval = fs->interval = 1.0 / fps;
+    fs->deadline = now_sec();
+    fs->poll_stdin = true;
+    pthread_sigmask(SIG_BLOCK, NULL, &fs->wait_mask);
+    sigemptyset(&fs->tty_signals);
+}
+
+// Blocks the signals whose handlers set flags for the main loop; sched_wait()
+// unblocks them for the duration of the wait only.
+static void sched_block_signals(FrameSched *fs) {
+    static const int SIGNALS[] = { SIGWINCH, SIGTSTP, SIGUSR1, SIGUSR2, SIGINT, SIGTERM, SIGHUP };
+    sigset_t set;
+    sigemptyset(&set);
+    for (size_t i = 0; i < sizeof(SIGNALS) / sizeof(SIGNALS[0]); ++i) sigaddset(&set, SIGNALS[i]);
+    pthread_sigmask(SIG_BLOCK, &set, &fs->wait_mask);
+    for (size_t i = 0; i < sizeof(SIGNALS) / sizeof(SIGNALS[0]); ++i) sigdelset(&fs->wait_mask, SIGNALS[i]);
+    sigaddset(&fs->tty_signals, SIGINT);
+    sigaddset(&fs->tty_signals, SIGTSTP);
+}
+
+// ^C and ^Z make the tty discard its queued output, and a write() blocked
+// on that queue is then woken by nothing but a signal. So SIGINT and SIGTSTP
+// stay deliverable while the main thread writes a frame; sched_wait() looks
+// at the flags they set before it waits.
+static void sched_output(FrameSched *fs, bool writing) {
+    pthread_sigmask(writing ? SIG_UNBLOCK : SIG_BLOCK, &fs->tty_signals, NULL);
+}
+
+// Blocks until the next frame is due (SCHED_FRAME), stdin is readable
+// (SCHED_INPUT) or a signal such as SIGWINCH arrived (SCHED_SIGNAL).
+static int sched_wait(FrameSched *fs) {
+    if (g_quit || g_suspend) return SCHED_SIGNAL; // arrived in sched_output()
+    for (;;) {
+        // An overdue frame still polls once without waiting, so pending
+        // signals and input get in even while every frame runs late.
+        double left = fs->paused ? 1.0 : fs->deadline - now_sec();
+        struct timespec ts = timespec_from_sec(left > 0 ? left : 0);
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        int r = ppoll(&pfd, fs->poll_stdin ? 1 : 0, fs->paused ? NULL : &ts, &fs->wait_mask);
+        if (r == 0 && !fs->paused) return SCHED_FRAME;
+        if (r < 0) {
+            if (errno == EINTR) return SCHED_SIGNAL;
+            fs->poll_stdin = false;
+        } else if (r > 0) {
+            if (pfd.revents & POLLIN) return SCHED_INPUT;
+            fs->poll_stdin = false; // POLLHUP/POLLERR: stop waking up for stdin
+        }
+    }
+}
+
+// Call when a frame starts at `now`. A late frame reschedules from now
+// instead of bursting to catch up.
+static void sched_begin_frame(FrameSched *fs, double now) {
+    fs->deadline += fs->interval;
+    if (fs->deadline <= now) fs->deadline = now + fs->interval;
+}
+
+static void sched_update_interval(FrameSched *fs) {
+    int shift = fs->idle_shift > fs->out_shift ? fs->idle_shift : fs->out_shift;
+    fs->interval = fs->base_interval * (double)(1 << shift);
+    if (fs->interval < fs->min_interval) fs->interval = fs->min_interval;
+}
+
+// Something the user should see promptly happened (key press, resize).
+static void sched_wake(FrameSched *fs) {
+    fs->idle_shift = fs->idle_frames = 0;
+    sched_update_interval(fs);
+    fs->deadline = now_sec();
+}
+
+static void sched_pause(FrameSched *fs, bool paused) {
+    if (paused == fs->paused) return;
+    fs->paused = paused;
+    if (!paused) sched_wake(fs);
+}
+
+static long tty_pending_output(void) {
+#ifdef TIOCOUTQ
+    int n = 0;
+    if (ioctl(STDOUT_FILENO, TIOCOUTQ, &n) == 0) return n;
+#endif
+    return 0;
+}
+
+// Feeds back whether the frame differed from the previous one and how many
+// bytes are still waiting in the tty queue.
+static void sched_end_frame(FrameSched *fs, bool changed, long pending) {
+    if (changed) {
+        fs->idle_shift = fs->idle_frames = 0;
+    } else if (++fs->idle_frames >= SCHED_IDLE_FRAMES) {
+        fs->idle_frames = 0;
+        if (fs->idle_shift < SCHED_MAX_BACKOFF) ++fs->idle_shift;
+    }
+
+    if (pending > SCHED_OUTQ_HIGH) {
+        fs->drained_frames = 0;
+        if (fs->out_shift < SCHED_MAX_BACKOFF) ++fs->out_shift;
+    } else if (pending == 0 && fs->out_shift > 0 && ++fs->drained_frames >= SCHED_DRAIN_FRAMES) {
+        fs->drained_frames = 0;
+        --fs->out_shift;
+    }
+    sched_update_interval(fs);
+}
+
+// --- level of detail ---
+// --frame-budget-ms: a moving average of each frame's own work (simulate,
+// render, present) steers Sim.lod. Over budget it steps down after a few
+// frames; it steps back up only after a long run well under budget, and the
+// band in between changes nothing, so the level settles instead of hunting.
+#define LOD_DOWN_FRAMES 8
+#define LOD_UP_FRAMES   60
+static const double LOD_UP_FRACTION = 0.6; // "well under": below this share of the budget
+
+typedef struct {
+    double budget_ms; // 0: controller off
+    double avg_ms;
+    int over, under;  // consecutive frames above budget / well below it
+} LodCtl;
+
+// Feeds one frame's work time and returns the level to use from now on.
+static double lod_update(LodCtl *c, double lod, double frame_ms) {
+    if (c->budget_ms <= 0) return lod;
+    c->avg_ms += (frame_ms - c->avg_ms) * 0.1;
+    if (c->avg_ms > c->budget_ms) {
+        c->under = 0;
+        if (++c->over >= LOD_DOWN_FRAMES) { c->over = 0; lod *= 0.8; }
+    } else if (c->avg_ms < c->budget_ms * LOD_UP_FRACTION) {
+        c->over = 0;
+        if (++c->under >= LOD_UP_FRAMES) { c->under = 0; lod *= 1.1; }
+    } else {
+        c->over = c->under = 0;
+    }
+    return lod < LOD_MIN ? LOD_MIN : lod > 1.0 ? 1.0 : lod;
+}
+
+// --- output budget ---
+// --max-bytes-per-sec, for serial consoles and slow links. What each frame
+// wrote to the terminal (as FrameStats counts it, so both backends and the
+// render thread are covered) is charged to a token bucket; while it is
+// overdrawn the next frame waits until the debt is paid, so frames are
+// skipped instead of piling up in the tty queue. When the budget would space
+// frames wider than OUT_SLOW_INTERVAL the level steps up: the slower half of
+// the dim drops goes first, then only every second and then every fourth row
+// is sent per frame, in rotation. Stepping back down takes a long run with room to spare, as in
+// lod_update().
+#define OUT_LEVELS 4 // full, fewer dim drops, 1/2 of the rows, 1/4 of the rows
+static const double OUT_SLOW_INTERVAL = 0.05; // seconds per frame the budget should allow
+static const double OUT_BURST = 0.25;         // seconds of unused budget that can be saved up
+
+typedef struct {
+    double rate;      // bytes per second, 0: off
+    double debt;      // bytes sent beyond the budget; negative: saved up
+    double last;      // when the previous frame was charged
+    double avg_bytes; // per frame, moving average
+    int level;        // 0 .. OUT_LEVELS-1
+    int over, under;  // consecutive frames needing more room / leaving plenty
+} OutLimit;
+
+static void outlim_init(OutLimit *ol, double rate, double now) {
+    memset(ol, 0, sizeof(*ol));
+    ol->rate = rate;
+    ol->last = now;
+}
+
+// Charges one frame's `bytes` at `now` and returns when the next frame may
+// start at the earliest.
+static double outlim_charge(OutLimit *ol, long long bytes, double now) {
+    ol->debt += (double)bytes - ol->rate * (now - ol->last);
+    ol->last = now;
+    if (ol->debt < -ol->rate * OUT_BURST) ol->debt = -ol->rate * OUT_BURST;
+
+    ol->avg_bytes += ((double)bytes - ol->avg_bytes) * 0.1;
+    double need = ol->avg_bytes / ol->rate;
+    if (need > OUT_SLOW_INTERVAL) {
+        ol->under = 0;
+        if (++ol->over >= LOD_DOWN_FRAMES && ol->level < OUT_LEVELS - 1) { ol->over = 0; ++ol->level; }
+    } else if (need < OUT_SLOW_INTERVAL * 0.4) {
+        ol->over = 0;
+        if (++ol->under >= LOD_UP_FRAMES && ol->level > 0) { ol->under = 0; --ol->level; }
+    } else {
+        ol->over = ol->under = 0;
+    }
+    return ol->debt > 0 ? now + ol->debt / ol->rate : now;
+}
+
+static int outlim_row_step(const OutLimit *ol) {
+    return ol->level >= 2 ? 1 << (ol->level - 1) : 1;
+}
+
+// --- runtime statistics ---
+// Per-frame numbers for the 'f' overlay and --stats-file. Frame cost (sim +
+// render) is kept for the last STATS_WINDOW frames with a histogram of it in
+// power-of-two millisecond buckets, maintained incrementally as samples
+// enter and leave the window.
+#define STATS_WINDOW  128
+#define STATS_BUCKETS 7   // <1, <2, <4, <8, <16, <32, >=32 ms
+
+typedef struct {
+    double sim_ms, render_ms; // last frame
+    long long bytes;          // written to the terminal during the last frame
+    double fps;               // over the window
+    int drops, bolts, segments;
+    double lod;
+    long allocs;              // heap allocations so far (see heap_alloc)
+    size_t heap;              // live heap bytes
+
+    double start[STATS_WINDOW]; // frame start times
+    unsigned char bucket[STATS_WINDOW];
+    int head, count;
+    int hist[STATS_BUCKETS];
+
+    int io_fd;                // /proc/self/io, or -1 when byte counts are unavailable
+    long long wchar;          // its last wchar reading
+    long long own_bytes;      // our own --stats-file writes since that reading
+    int stats_fd;             // --stats-file, or -1
+} FrameStats;
+
+// Bytes every write() of this process has passed to the kernel; ncurses has
+// no hook on its output, so terminal traffic is the growth of this counter.
+static long long proc_wchar(int fd) {
+    char buf[512];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    const char *p = strstr(buf, "wchar:");
+    return p ? strtoll(p + 6, NULL, 10) : -1;
+}
+
+static bool stats_init(FrameStats *st, const char *path) {
+    memset(st, 0, sizeof(*st));
+    st->stats_fd = -1;
+    st->io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    if (st->io_fd >= 0) st->wchar = proc_wchar(st->io_fd);
+    if (!path) return true;
+    st->stats_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (st->stats_fd < 0) return false;
+    static const char header[] = "time,fps,drops,bolts,segments,sim_us,render_us,bytes,lod,allocs,heap\n";
+    if (write(st->stats_fd, header, sizeof(header) - 1) > 0) st->own_bytes += sizeof(header) - 1;
+    return true;
+}
+
+static void stats_free(FrameStats *st) {
+    if (st->io_fd >= 0) close(st->io_fd);
+    if (st->stats_fd >= 0) close(st->stats_fd);
+    st->io_fd = st->stats_fd = -1;
+}
+
+static int stats_bucket(double ms) {
+    int b = 0;
+    for (double lim = 1.0; b < STATS_BUCKETS - 1 && ms >= lim; lim *= 2) ++b;
+    return b;
+}
+
+// Counts are totals over the panes; they all share one level of detail.
+static void stats_frame(FrameStats *st, const Panes *ps, double start, double sim_ms, double render_ms) {
+    st->sim_ms = sim_ms;
+    st->render_ms = render_ms;
+    st->drops = panes_drop_count(ps);
+    st->bolts = 0;
+    st->lod = ps->v[0].sim.lod;
+    st->allocs = atomic_load_explicit(&g_heap_allocs, memory_order_relaxed);
+    st->heap = atomic_load_explicit(&g_heap_bytes, memory_order_relaxed);
+    st->segments = 0;
+    for (int k = 0; k < ps->n; ++k) {
+        const Sim *s = &ps->v[k].sim;
+        st->bolts += s->bolts.n;
+        for (int i = 0; i < s->bolts.n; ++i) st->segments += s->bolts.v[i].revealed - s->bolts.v[i].seg_head;
+    }
+
+    if (st->io_fd >= 0) {
+        long long w = proc_wchar(st->io_fd);
+        st->bytes = w >= 0 ? w - st->wchar - st->own_bytes : 0;
+        st->wchar = w;
+        st->own_bytes = 0;
+    }
+
+    int slot = (st->head + st->count) % STATS_WINDOW;
+    if (st->count == STATS_WINDOW) {
+        --st->hist[st->bucket[st->head]];
+        st->head = (st->head + 1) % STATS_WINDOW;
+    } else {
+        ++st->count;
+    }
+    st->start[slot] = start;
+    st->bucket[slot] = (unsigned char)stats_bucket(sim_ms + render_ms);
+    ++st->hist[st->bucket[slot]];
+
+    double span = start - st->start[st->head];
+    st->fps = span > 0 ? (st->count - 1) / span : 0;
+
+    if (st->stats_fd >= 0) {
+        char line[160];
+        int n = snprintf(line, sizeof(line), "%.6f,%.2f,%d,%d,%d,%.0f,%.0f,%lld,%.3f,%ld,%zu\n",
+                         start, st->fps, st->drops, st->bolts, st->segments,
+                         sim_ms * 1e3, render_ms * 1e3, st->bytes, st->lod, st->allocs, st->heap);
+        if (n > 0 && write(st->stats_fd, line, n) > 0) st->own_bytes += n;
+    }
+}
+
+// Two reverse-video lines in the top-left corner; drawn into the frame so it
+// goes out through the same present path as everything else.
+static void stats_draw(const FrameStats *st, Canvas *cv) {
+    char line[256];
+    snprintf(line, sizeof(line), " fps %.1f  drops %d  bolts %d  segs %d  sim %.2fms  render %.2fms  out %lldB  lod %.2f ",
+             st->fps, st->drops, st->bolts, st->segments, st->sim_ms, st->render_ms, st->bytes, st->lod);
+    canvas_puts(cv, 0, 0, line, A_REVERSE);
+
+    static const char *labels[STATS_BUCKETS] = { "<1", "<2", "<4", "<8", "<16", "<32", ">32" };
+    int n = snprintf(line, sizeof(line), " frame ms:");
+    for (int b = 0; b < STATS_BUCKETS && n < (int)sizeof(line); ++b)
+        n += snprintf(line + n, sizeof(line) - n, " %s:%d", labels[b], st->hist[b]);
+    if (n < (int)sizeof(line))
+        snprintf(line + n, sizeof(line) - n, "  allocs %ld  heap %zuK ", st->allocs, st->heap / 1024);
+    canvas_puts(cv, 1, 0, line, A_REVERSE);
+}
+
+// --- main sim ---
+// Returns the COLORS_* mode set up: a gradient needs 256 colors and enough
+// pairs, and truecolor comes out as its nearest 256-color approximation.
+static int setup_colors(const char *rain_name, const char *lightning_name, int colors,
+                        chtype *rain_attr, chtype *light_attr) {
+    *rain_attr = A_NORMAL;
+    *light_attr = A_BOLD;
+
+    if (!has_colors()) return COLORS_8;
+
+    start_color();
+#ifdef NCURSES_VERSION
+    use_default_colors();
+#endif
+
+    short bg = -1;
+    short rain_fg = color_from_name(rain_name, COLOR_CYAN);
+    short light_fg = color_from_name(lightning_name, COLOR_YELLOW);
+
+    init_pair(CP_RAIN_NORMAL, rain_fg, bg);
+    init_pair(CP_LIGHTNING,   light_fg, bg);
+
+    *rain_attr  = COLOR_PAIR(CP_RAIN_NORMAL);
+    *light_attr = COLOR_PAIR(CP_LIGHTNING) | A_BOLD;
+
+    if (colors == COLORS_8 || COLORS < 256 || COLOR_PAIRS < CP_FADE_STEP + FADE_STEPS) return COLORS_8;
+    Rgb rain = color_rgb(rain_fg), light = color_rgb(light_fg);
+    for (int k = 0; k < RAIN_SHADES; ++k)
+        init_pair(CP_RAIN_SHADE + k, rgb_to_256(rain_shade_rgb(rain, k)), bg);
+    for (int k = 0; k < FADE_STEPS; ++k)
+        init_pair(CP_FADE_STEP + k, rgb_to_256(fade_step_rgb(light, k)), bg);
+    *rain_attr  = A_NORMAL; // the shaded looks and fade steps bring their pairs
+    *light_attr = A_BOLD;
+    return COLORS_256;
+}
+
+// --- attribute bytes ---
+// The attributes we draw with, in one byte: bold, dim, reverse and the color
+// pair (below 32). Recordings store cells this way and the ANSI backend keys
+// its SGR cache on it.
+enum { ATTR_BYTE_BOLD = 1, ATTR_BYTE_DIM = 2, ATTR_BYTE_REVERSE = 4, ATTR_BYTE_PAIR_SHIFT = 3 };
+
+static unsigned char attr_to_byte(chtype attr) {
+    unsigned a = 0;
+    if (attr & A_BOLD) a |= ATTR_BYTE_BOLD;
+    if (attr & A_DIM) a |= ATTR_BYTE_DIM;
+    if (attr & A_REVERSE) a |= ATTR_BYTE_REVERSE;
+    return (unsigned char)(a | (PAIR_NUMBER(attr) & 31) << ATTR_BYTE_PAIR_SHIFT);
+}
+
+static chtype attr_from_byte(unsigned a) {
+    chtype attr = COLOR_PAIR(a >> ATTR_BYTE_PAIR_SHIFT);
+    if (a & ATTR_BYTE_BOLD) attr |= A_BOLD;
+    if (a & ATTR_BYTE_DIM) attr |= A_DIM;
+    if (a & ATTR_BYTE_REVERSE) attr |= A_REVERSE;
+    return attr;
+}
+
+// --- output backends ---
+// The curses backend hands cells to ncurses, which diffs and encodes them.
+// The ANSI backend diffs the damage-tracked Canvas itself: changed cells are
+// grouped by attribute and visited in row order within a group, the cursor
+// is moved only across gaps, SGR is sent only when attributes change (from a
+// table encoded once per pair), and the whole frame leaves in one write()
+// from a buffer sized for the worst case up front. --bench can run either one
+// headless against /dev/null.
+enum { BACKEND_CURSES, BACKEND_ANSI };
+
+#define ANSI_MAX_PAIRS 32  // what an attribute byte holds
+_Static_assert(CP_FADE_STEP + FADE_STEPS <= ANSI_MAX_PAIRS, "fade step pairs do not fit an attribute byte");
+#define ANSI_FG_MAX    20  // one pair's color parameters, e.g. "38;2;255;255;255"
+#define ANSI_SGR_MAX   32  // one attribute byte's whole SGR sequence
+#define ANSI_CELL_MAX  48  // worst-case bytes per cell: cursor move + SGR + glyph
+#define ANSI_ATTR_UNKNOWN ((chtype)-1)
+#define SKY_GLOW_COLOR "#262a3a" // --flash: background while bolts are out
+
+typedef struct {
+    int kind;
+    bool headless;
+    FILE *null_out;          // curses, headless: newterm() output
+    SCREEN *scr;
+    // ANSI backend
+    int out_fd;
+    bool raw_tty;            // termios changed; restore on close
+    struct termios saved_tio;
+    char *out;
+    size_t out_len, out_cap;
+    int rows, cols;
+    int *row_lo, *row_hi;    // dirty column span per row while presenting
+    chtype cur_attr;         // what the terminal has, or ANSI_ATTR_UNKNOWN
+    int cur_y, cur_x;        // cursor, cur_y < 0 when unknown
+    char sgr[256][ANSI_SGR_MAX];   // SGR per attribute byte, see ansi_build_sgr()
+    unsigned char sgr_len[256];
+    int *pend, *order;       // a frame's changed cells, then grouped by attribute
+    size_t pend_cap;
+    int colors;              // COLORS_*, what --colors came down to on this terminal
+    unsigned char in[64];
+    int in_len, in_pos;
+    bool raw_input;          // read keys from stdin directly, whatever the backend
+    bool focus_events;       // terminal reports focus changes (--low-power)
+    int sky;                 // SKY_* effects the terminal is showing (--flash)
+    bool osc_colors;         // understands OSC 11 to set the background
+} Term;
+
+// term_getkey() results besides characters, from focus reporting.
+#define TERM_FOCUS_IN  (KEY_MAX + 1)
+#define TERM_FOCUS_OUT (KEY_MAX + 2)
+
+static void ansi_put(Term *t, const char *s, size_t n) {
+    memcpy(t->out + t->out_len, s, n);
+    t->out_len += n;
+}
+
+static void ansi_flush(Term *t) {
+    size_t off = 0;
+    while (off < t->out_len) {
+        ssize_t n = write(t->out_fd, t->out + off, t->out_len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        off += (size_t)n;
+    }
+    t->out_len = 0;
+}
+
+// Sizes the output buffer and row spans for a rows x cols screen.
+static bool ansi_reserve(Term *t, int rows, int cols) {
+    size_t cap = (size_t)rows * cols * ANSI_CELL_MAX + 256;
+    if (cap > t->out_cap) {
+        char *out = (char*)heap_realloc(t->out, cap);
+        if (!out) return false;
+        t->out = out;
+        t->out_cap = cap;
+    }
+    size_t cells = (size_t)rows * cols;
+    if (cells > t->pend_cap) {
+        int *pend = (int*)heap_realloc(t->pend, cells * sizeof(*pend));
+        if (pend) t->pend = pend;
+        int *order = (int*)heap_realloc(t->order, cells * sizeof(*order));
+        if (order) t->order = order;
+        if (!pend || !order) return false;
+        t->pend_cap = cells;
+    }
+    if (rows > t->rows) {
+        int *lo = (int*)heap_realloc(t->row_lo, rows * sizeof(*lo));
+        if (lo) t->row_lo = lo;
+        int *hi = (int*)heap_realloc(t->row_hi, rows * sizeof(*hi));
+        if (hi) t->row_hi = hi;
+        if (!lo || !hi) return false;
+    }
+    t->rows = rows;
+    t->cols = cols;
+    for (int y = 0; y < rows; ++y) { t->row_lo[y] = cols; t->row_hi[y] = -1; }
+    return true;
+}
+
+// Encodes the SGR sequence of every attribute byte up front, so sending one
+// is a copy. fg[pair] holds each pair's color parameters, "" for the
+// terminal's default; NULL leaves every pair uncolored.
+static void ansi_build_sgr(Term *t, const char (*fg)[ANSI_FG_MAX]) {
+    for (int a = 0; a < 256; ++a) {
+        char *buf = t->sgr[a];
+        int n = 0;
+        buf[n++] = '\033'; buf[n++] = '['; buf[n++] = '0';
+        if (a & ATTR_BYTE_BOLD)    { buf[n++] = ';'; buf[n++] = '1'; }
+        if (a & ATTR_BYTE_DIM)     { buf[n++] = ';'; buf[n++] = '2'; }
+        if (a & ATTR_BYTE_REVERSE) { buf[n++] = ';'; buf[n++] = '7'; }
+        const char *color = fg ? fg[a >> ATTR_BYTE_PAIR_SHIFT] : "";
+        if (*color) n += snprintf(buf + n, ANSI_SGR_MAX - n, ";%s", color);
+        buf[n++] = 'm';
+        t->sgr_len[a] = (unsigned char)n;
+    }
+}
+
+static void ansi_sgr(Term *t, chtype attr) {
+    unsigned char a = attr_to_byte(attr);
+    ansi_put(t, t->sgr[a], t->sgr_len[a]);
+    t->cur_attr = attr;
+}
+
+static void ansi_move(Term *t, int y, int x) {
+    if (y == t->cur_y && x == t->cur_x) return;
+    char buf[32];
+    int n;
+    if (y == t->cur_y && x > t->cur_x)
+        n = (x - t->cur_x == 1) ? snprintf(buf, sizeof(buf), "\033[C")
+                                : snprintf(buf, sizeof(buf), "\033[%dC", x - t->cur_x);
+    else
+        n = snprintf(buf, sizeof(buf), "\033[%d;%dH", y + 1, x + 1);
+    ansi_put(t, buf, n);
+    t->cur_y = y;
+    t->cur_x = x;
+}
+
+static void ansi_cell(Term *t, int y, int x, chtype ch) {
+    ansi_move(t, y, x);
+    chtype attr = ch & A_ATTRIBUTES;
+    char glyph = (char)(ch & A_CHARTEXT);
+    if (ch == 0) {
+        // A blank looks the same under any attributes but reverse video.
+        glyph = ' ';
+        attr = (t->cur_attr != ANSI_ATTR_UNKNOWN && !(t->cur_attr & A_REVERSE)) ? t->cur_attr : 0;
+    }
+    if (attr != t->cur_attr) ansi_sgr(t, attr);
+    t->out[t->out_len++] = glyph;
+    // Past the last column the cursor is in the pending-wrap state.
+    if (++t->cur_x >= t->cols) t->cur_y = -1;
+}
+
+// Sends the cells t->pend[0, n) of `cells`, which are in row order. With a
+// gradient palette they go grouped by attribute, so each group costs one SGR
+// however finely the shades split the frame; blanks look the same under any
+// attribute but reverse and go with the largest such group. Within a group
+// the cells keep their row order, so cursor moves stay short. Eight colors
+// leave too few groups for this to pay.
+static void ansi_send_pending(Term *t, const chtype *cells, int n, int cols) {
+    if (t->colors == COLORS_8) {
+        for (int k = 0; k < n; ++k) ansi_cell(t, t->pend[k] / cols, t->pend[k] % cols, cells[t->pend[k]]);
+        return;
+    }
+    int start[257] = {0}; // key: attribute byte, 256 for blanks until placed
+    for (int k = 0; k < n; ++k) {
+        chtype ch = cells[t->pend[k]];
+        ++start[ch ? attr_to_byte(ch & A_ATTRIBUTES) : 256];
+    }
+    int blank_key = 0;
+    for (int key = 1; key < 256; ++key)
+        if (!(key & ATTR_BYTE_REVERSE) && start[key] > start[blank_key]) blank_key = key;
+    start[blank_key] += start[256];
+    for (int key = 0, sum = 0; key < 256; ++key) {
+        int c = start[key];
+        start[key] = sum;
+        sum += c;
+    }
+    for (int k = 0; k < n; ++k) {
+        chtype ch = cells[t->pend[k]];
+        t->order[start[ch ? attr_to_byte(ch & A_ATTRIBUTES) : blank_key]++] = t->pend[k];
+    }
+    for (int k = 0; k < n; ++k) {
+        int i = t->order[k];
+        ansi_cell(t, i / cols, i % cols, cells[i]);
+    }
+}
+
+static inline void ansi_mark(Term *t, int i, int cols) {
+    int y = i / cols, x = i % cols;
+    if (x < t->row_lo[y]) t->row_lo[y] = x;
+    if (x > t->row_hi[y]) t->row_hi[y] = x;
+}
+
+// Appends the cells of `cv` that differ from its shadow to the output buffer
+// and updates the shadow; the compose buffer is left alone.
+static void ansi_encode_diff(Term *t, Canvas *cv) {
+    int cols = cv->cols, n = 0;
+    for (int k = 0; k < cv->nprev; ++k) ansi_mark(t, cv->prev[k], cols);
+    for (int k = 0; k < cv->ntouched; ++k) ansi_mark(t, cv->touched[k], cols);
+
+    for (int y = 0; y < cv->rows; ++y) {
+        if (!canvas_row_due(cv, y)) {
+            if (t->row_hi[y] >= 0) cv->stale[y] = 1;
+            t->row_lo[y] = cols;
+            t->row_hi[y] = -1;
+            continue;
+        }
+        if (cv->stale[y]) {
+            cv->stale[y] = 0;
+            t->row_lo[y] = 0;
+            t->row_hi[y] = cols - 1;
+        }
+        if (t->row_hi[y] < 0) continue;
+        chtype *cells = cv->cells + (size_t)y * cols;
+        chtype *shadow = cv->shadow + (size_t)y * cols;
+        for (int x = t->row_lo[y]; x <= t->row_hi[y]; ++x) {
+            if (cells[x] == shadow[x]) continue;
+            t->pend[n++] = y * cols + x;
+            shadow[x] = cells[x];
+        }
+        t->row_lo[y] = cols;
+        t->row_hi[y] = -1;
+    }
+    ansi_send_pending(t, cv->cells, n, cols);
+}
+
+// Appends a clear screen and every drawn cell of `cv`, as if the terminal
+// showed nothing before; the shadow is not consulted.
+static void ansi_encode_key(Term *t, const Canvas *cv) {
+    int cols = cv->cols, n = 0;
+    ansi_put(t, "\033[0m\033[2J", 8);
+    t->cur_attr = 0;
+    t->cur_y = -1;
+    for (int k = 0; k < cv->ntouched; ++k) ansi_mark(t, cv->touched[k], cols);
+    for (int y = 0; y < cv->rows; ++y) {
+        if (t->row_hi[y] < 0) continue;
+        const chtype *cells = cv->cells + (size_t)y * cols;
+        for (int x = t->row_lo[y]; x <= t->row_hi[y]; ++x)
+            if (cells[x]) t->pend[n++] = y * cols + x;
+        t->row_lo[y] = cols;
+        t->row_hi[y] = -1;
+    }
+    ansi_send_pending(t, cv->cells, n, cols);
+}
+
+static void ansi_present(Term *t, Canvas *cv) {
+    ansi_encode_diff(t, cv);
+    canvas_end_frame(cv);
+    ansi_flush(t);
+}
+
+static void ansi_window_size(int *rows, int *cols) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0) {
+        *rows = ws.ws_row;
+        *cols = ws.ws_col;
+    } else {
+        *rows = 24;
+        *cols = 80;
+    }
+}
+
+static void term_write(const char *s) {
+    if (write(STDOUT_FILENO, s, strlen(s)) < 0) { /* nothing left to do */ }
+}
+
+// Raw input and the alternate screen; ansi_leave() undoes both.
+static bool ansi_enter(Term *t) {
+    if (t->raw_tty) {
+        struct termios tio = t->saved_tio;
+        tio.c_lflag &= ~(ICANON | ECHO);
+        tio.c_cc[VMIN] = 0;
+        tio.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &tio);
+    }
+    static const char enter[] = "\033[?1049h\033[?25l\033[0m\033[2J";
+    if (write(t->out_fd, enter, sizeof(enter) - 1) < 0) return false;
+    t->cur_attr = 0;
+    t->cur_y = -1;
+    return true;
+}
+
+static void ansi_leave(Term *t) {
+    static const char leave[] = "\033[0m\033[?25h\033[?1049l";
+    if (write(t->out_fd, leave, sizeof(leave) - 1) < 0) { /* nothing left to do */ }
+    if (t->raw_tty) tcsetattr(STDIN_FILENO, TCSANOW, &t->saved_tio);
+}
+
+// Asks the terminal to report focus in/out as ESC [ I / ESC [ O.
+static void term_focus_events(Term *t, bool on) {
+    t->focus_events = on;
+    term_write(on ? "\033[?1004h" : "\033[?1004l");
+}
+
+// Whole-screen effects for --flash: DECSCNM reverses every cell and OSC 11
+// recolors the default background, each a few bytes that the terminal
+// applies to what is already on screen. Sent right after the frame it goes with.
+static void term_sky(Term *t, int sky) {
+    if (t->headless || sky == t->sky) return;
+    char buf[32] = "";
+    if ((sky ^ t->sky) & SKY_FLASH) strcat(buf, sky & SKY_FLASH ? "\033[?5h" : "\033[?5l");
+    if (((sky ^ t->sky) & SKY_GLOW) && t->osc_colors)
+        strcat(buf, sky & SKY_GLOW ? "\033]11;" SKY_GLOW_COLOR "\007" : "\033]111\007");
+    t->sky = sky;
+    if (*buf) term_write(buf);
+}
+
+// Hands the terminal back to the shell for a job-control stop, and takes it
+// again afterwards; the caller redraws everything.
+static void term_suspend(Term *t) {
+    term_sky(t, 0);
+    if (t->focus_events) term_write("\033[?1004l");
+    if (t->kind == BACKEND_CURSES) endwin();
+    else ansi_leave(t);
+}
+
+static void term_resume(Term *t) {
+    if (t->kind == BACKEND_CURSES) refresh();
+    else ansi_enter(t);
+    if (t->focus_events) term_write("\033[?1004h");
+}
+
+// Headless terminals are for --bench: output to /dev/null, input untouched.
+static bool term_open(Term *t, int kind, bool headless) {
+    memset(t, 0, sizeof(*t));
+    t->kind = kind;
+    t->headless = headless;
+    t->out_fd = -1;
+    t->cur_attr = ANSI_ATTR_UNKNOWN;
+    t->cur_y = -1;
+    ansi_build_sgr(t, NULL);
+    const char *term_name = getenv("TERM");
+    t->osc_colors = !term_name || strncmp(term_name, "linux", 5) != 0; // the console has no OSC 11
+
+    if (kind == BACKEND_CURSES) {
+        if (headless) {
+            const char *term = getenv("TERM");
+            t->null_out = fopen("/dev/null", "w");
+            if (!t->null_out) return false;
+            t->scr = newterm(term && strcmp(term, "dumb") ? term : "xterm", t->null_out, stdin);
+            if (!t->scr) return false;
+        } else {
+            initscr();
+        }
+        cbreak();
+        noecho();
+        keypad(stdscr, TRUE);
+        nodelay(stdscr, TRUE); // input is waited for in sched_wait()
+        curs_set(0);
+        return true;
+    }
+
+    if (headless) {
+        t->out_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        return t->out_fd >= 0;
+    }
+
+    t->out_fd = STDOUT_FILENO;
+    t->raw_tty = tcgetattr(STDIN_FILENO, &t->saved_tio) == 0;
+    set_signal(SIGINT, on_quit);
+    set_signal(SIGTERM, on_quit);
+    set_signal(SIGHUP, on_quit);
+    return ansi_enter(t);
+}
+
+static void term_close(Term *t) {
+    term_sky(t, 0);
+    if (t->focus_events) term_focus_events(t, false);
+    if (t->kind == BACKEND_CURSES) {
+        endwin();
+        if (t->scr) delscreen(t->scr);
+        if (t->null_out) fclose(t->null_out);
+    } else if (t->out_fd >= 0) {
+        if (!t->headless) {
+            ansi_leave(t);
+        } else {
+            close(t->out_fd);
+        }
+    }
+    heap_free(t->out); heap_free(t->row_lo); heap_free(t->row_hi);
+    heap_free(t->pend); heap_free(t->order);
+    memset(t, 0, sizeof(*t));
+}
+
+static void term_size(Term *t, int *rows, int *cols) {
+    if (t->kind == BACKEND_CURSES) getmaxyx(stdscr, *rows, *cols);
+    else ansi_window_size(rows, cols);
+}
+
+// After SIGWINCH: let the backend pick up the new size and blank the screen.
+static void term_resized(Term *t, int *rows, int *cols) {
+    if (t->kind == BACKEND_CURSES) {
+#ifdef NCURSES_VERSION
+        // Our SIGWINCH handler replaces ncurses' own, so tell it the size.
+        ansi_window_size(rows, cols);
+        resizeterm(*rows, *cols);
+#endif
+        getmaxyx(stdscr, *rows, *cols);
+        clear();
+    } else {
+        ansi_window_size(rows, cols);
+        ansi_put(t, "\033[0m\033[2J", 8);
+        t->cur_attr = 0;
+        t->cur_y = -1;
+    }
+}
+
+// One pair's SGR color parameters for --colors 256 or truecolor.
+static void ansi_fg(char *buf, int colors, Rgb c) {
+    if (colors == COLORS_TRUE) snprintf(buf, ANSI_FG_MAX, "38;2;%d;%d;%d", c.r, c.g, c.b);
+    else snprintf(buf, ANSI_FG_MAX, "38;5;%d", rgb_to_256(c));
+}
+
+// Rain and lightning attributes, plus the SGR table the ANSI encoder uses.
+// Returns, and keeps in t->colors, the COLORS_* mode the terminal got; with
+// a gradient the caller must sim_set_shaded() its simulation.
+static int term_setup_colors(Term *t, const char *rain_name, const char *lightning_name, int colors,
+                             chtype *rain_attr, chtype *light_attr) {
+    if (t->kind == BACKEND_CURSES)
+        return t->colors = setup_colors(rain_name, lightning_name, colors, rain_attr, light_attr);
+    char fg[ANSI_MAX_PAIRS][ANSI_FG_MAX] = {{0}};
+    short rain_fg = color_from_name(rain_name, COLOR_CYAN);
+    short light_fg = color_from_name(lightning_name, COLOR_YELLOW);
+    snprintf(fg[CP_RAIN_NORMAL], ANSI_FG_MAX, "3%d", rain_fg);
+    snprintf(fg[CP_LIGHTNING], ANSI_FG_MAX, "3%d", light_fg);
+    *rain_attr  = COLOR_PAIR(CP_RAIN_NORMAL);
+    *light_attr = COLOR_PAIR(CP_LIGHTNING) | A_BOLD;
+    if (colors != COLORS_8) {
+        for (int k = 0; k < RAIN_SHADES; ++k) ansi_fg(fg[CP_RAIN_SHADE + k], colors, rain_shade_rgb(color_rgb(rain_fg), k));
+        for (int k = 0; k < FADE_STEPS; ++k) ansi_fg(fg[CP_FADE_STEP + k], colors, fade_step_rgb(color_rgb(light_fg), k));
+        *rain_attr  = A_NORMAL;
+        *light_attr = A_BOLD;
+    }
+    ansi_build_sgr(t, fg);
+    return t->colors = colors;
+}
+
+// Next key press, or ERR. The ANSI backend swallows escape sequences that
+// arrive in one read (arrow keys and the like) so they do not look like ESC,
+// except focus reports, which come back as TERM_FOCUS_IN/OUT.
+// With `raw_input` curses is bypassed too: getch() may refresh stdscr, which
+// must not happen while another thread owns the output.
+static int term_getkey(Term *t) {
+    if (t->kind == BACKEND_CURSES && !t->raw_input) return getch();
+    for (;;) {
+        if (t->in_pos >= t->in_len) {
+            // cbreak() leaves VMIN at 1, so under curses read() would block.
+            struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+            if (t->kind == BACKEND_CURSES && poll(&pfd, 1, 0) <= 0) return ERR;
+            ssize_t n = read(STDIN_FILENO, t->in, sizeof(t->in));
+            if (n <= 0) return ERR;
+            t->in_len = (int)n;
+            t->in_pos = 0;
+        }
+        int c = t->in[t->in_pos++];
+        if (c != 27 || t->in_pos >= t->in_len) return c;
+        int c2 = t->in[t->in_pos];
+        if (c2 != '[' && c2 != 'O') return c;
+        ++t->in_pos;
+        if (c2 == '[' && t->in_pos < t->in_len && (t->in[t->in_pos] == 'I' || t->in[t->in_pos] == 'O'))
+            return t->in[t->in_pos++] == 'I' ? TERM_FOCUS_IN : TERM_FOCUS_OUT;
+        while (t->in_pos < t->in_len) {
+            int f = t->in[t->in_pos++];
+            if (f >= 0x40 && f <= 0x7e) break;
+        }
+    }
+}
+
+// Blanks the terminal; the Canvas forgets what it believed was shown.
+static void term_clear(Term *t, Canvas *cv) {
+    if (t->kind == BACKEND_CURSES) {
+        clear();
+    } else {
+        ansi_put(t, "\033[0m\033[2J", 8);
+        t->cur_attr = 0;
+        t->cur_y = -1;
+    }
+    canvas_invalidate(cv);
+}
+
+static void term_present(Term *t, Canvas *cv) {
+    if (t->kind == BACKEND_CURSES) {
+        if (cv->shadow) canvas_present(cv);
+        refresh();
+    } else {
+        ansi_present(t, cv);
+    }
+}
+
+static int backend_from_name(const char *s) {
+    if (strcasecmp(s, "curses") == 0 || strcasecmp(s, "ncurses") == 0) return BACKEND_CURSES;
+    if (strcasecmp(s, "ansi") == 0 || strcasecmp(s, "raw") == 0) return BACKEND_ANSI;
+    return -1;
+}
+
+// --- render thread ---
+// With --render-thread the terminal is written from a thread of its own, so a
+// slow tty or SSH link stalls only the presenter while physics and input keep
+// going. The main thread composes into the `back` frame of a triple buffer and
+// swaps it with `middle`; the presenter swaps `middle` for its `front` whenever
+// the FRAME_FRESH bit says a newer frame is there. Frames it never got to are
+// simply overwritten. The swaps are single atomic exchanges, so neither side
+// ever waits for the other; the semaphore only lets an idle presenter sleep.
+#define FRAME_FRESH 4
+
+typedef struct {
+    Canvas frames[3];  // cells + touched, no shadow
+    atomic_int middle; // frame index, | FRAME_FRESH when not yet presented
+    int back;          // main thread's
+    int front;         // presenter's
+    Term *term;
+    Canvas *screen;    // presenter's damage canvas: what the terminal shows
+    pthread_t thread;
+    sem_t ready;
+    atomic_bool stop, clear;
+    atomic_int sky;    // --flash effects to show with the next frame
+    atomic_int row_step; // --max-bytes-per-sec: see Canvas.row_step
+    bool running;
+} Presenter;
+
+static void presenter_free(Presenter *p) {
+    for (int i = 0; i < 3; ++i) canvas_free(&p->frames[i]);
+}
+
+static bool presenter_init(Presenter *p, int rows, int cols) {
+    bool ok = true;
+    for (int i = 0; i < 3; ++i) ok = canvas_init_frame(&p->frames[i], rows, cols) && ok;
+    p->back = 0;
+    atomic_store(&p->middle, 1);
+    p->front = 2;
+    if (!ok) presenter_free(p);
+    return ok;
+}
+
+// The presenter must be stopped. Frames in flight are dropped.
+static bool presenter_resize(Presenter *p, int rows, int cols) {
+    for (int i = 0; i < 3; ++i)
+        if (!canvas_resize(&p->frames[i], rows, cols)) return false;
+    p->back = 0;
+    atomic_store(&p->middle, 1);
+    p->front = 2;
+    return true;
+}
+
+static void *presenter_thread(void *arg) {
+    Presenter *p = (Presenter*)arg;
+    Canvas *screen = p->screen;
+    for (;;) {
+        while (sem_wait(&p->ready) != 0 && errno == EINTR) {}
+        if (atomic_load(&p->stop)) break;
+        if (!(atomic_load(&p->middle) & FRAME_FRESH)) continue;
+        p->front = atomic_exchange(&p->middle, p->front) & ~FRAME_FRESH;
+        const Canvas *f = &p->frames[p->front];
+
+        if (atomic_exchange(&p->clear, false)) term_clear(p->term, screen);
+        for (int k = 0; k < f->ntouched; ++k) {
+            int i = f->touched[k];
+            if (screen->cells[i] == 0) screen->touched[screen->ntouched++] = i;
+            screen->cells[i] = f->cells[i];
+        }
+        canvas_set_row_step(screen, atomic_load(&p->row_step));
+        term_present(p->term, screen);
+        term_sky(p->term, atomic_load(&p->sky));
+    }
+    return NULL;
+}
+
+// `screen` must be a damage-tracked canvas of the frames' size.
+static bool presenter_start(Presenter *p, Term *term, Canvas *screen) {
+    p->term = term;
+    p->screen = screen;
+    atomic_store(&p->stop, false);
+    if (sem_init(&p->ready, 0, 0) != 0) return false;
+    p->running = thread_spawn(&p->thread, presenter_thread, p);
+    if (!p->running) sem_destroy(&p->ready);
+    return p->running;
+}
+
+static void presenter_stop(Presenter *p) {
+    if (!p->running) return;
+    atomic_store(&p->stop, true);
+    sem_post(&p->ready);
+    pthread_join(p->thread, NULL);
+    sem_destroy(&p->ready);
+    p->running = false;
+}
+
+// The frame to compose next, emptied.
+static Canvas *presenter_back(Presenter *p) {
+    Canvas *f = &p->frames[p->back];
+    canvas_clear(f);
+    return f;
+}
+
+static void presenter_publish(Presenter *p) {
+    p->back = atomic_exchange(&p->middle, p->back | FRAME_FRESH) & ~FRAME_FRESH;
+    sem_post(&p->ready);
+}
+
+// --- record and replay ---
+// --record FILE logs every frame as it left for the terminal; --replay FILE
+// puts the same frames through a backend again, on the recorded schedule or,
+// with --replay-fast, back to back (an output-only benchmark of a backend).
+//
+// Stream: "TWRC" 0x01, varint rows, varint cols, then records. All numbers
+// are unsigned LEB128 varints.
+//   0 (frame):  microseconds since the previous frame, change count, then
+//               per change in ascending cell order: gap since the previous
+//               change's cell + 1, glyph byte, attr byte (attr_to_byte()).
+//               A glyph of 0 blanks the cell.
+//   1 (resize): rows, cols; the screen starts out blank again.
+#define REC_MAGIC "TWRC\001"
+#define REC_FLUSH_AT 65536
+enum { REC_FRAME = 0, REC_RESIZE = 1 };
+static size_t varint_put(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) { p[n++] = (unsigned char)(v | 0x80); v >>= 7; }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+// Reads a varint at *pos, or returns false at a truncated or overlong one.
+static bool varint_get(const unsigned char *p, size_t len, size_t *pos, uint64_t *v) {
+    uint64_t r = 0;
+    for (int shift = 0; shift < 64 && *pos < len; shift += 7) {
+        unsigned char b = p[(*pos)++];
+        r |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) { *v = r; return true; }
+    }
+    return false;
+}
+
+// Whole file into a NUL-terminated buffer, or NULL with errno set.
+static char *read_file(const char *path, size_t *out_len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    size_t len = 0, cap = 4096, n;
+    char *text = (char*)heap_alloc(cap);
+    while (text && (n = fread(text + len, 1, cap - len - 1, f)) > 0) {
+        len += n;
+        if (cap - len == 1) {
+            char *t = (char*)heap_realloc(text, cap * 2);
+            if (!t) { heap_free(text); text = NULL; errno = ENOMEM; break; }
+            text = t;
+            cap *= 2;
+        }
+    }
+    fclose(f);
+    if (!text) return NULL;
+    text[len] = '\0';
+    if (out_len) *out_len = len;
+    return text;
+}
+
+typedef struct {
+    int fd;
+    int rows, cols;
+    chtype *shadow;      // what the last recorded frame showed
+    int *prev, nprev;    // its drawn cells
+    int *changed;        // scratch, up to two per cell
+    size_t cap;          // cells the buffers have room for
+    unsigned char *buf;
+    size_t len, buf_cap;
+    double last_t;
+    bool ok;             // false once a write failed
+} Recorder;
+
+static void rec_put(Recorder *r, const void *p, size_t n) {
+    memcpy(r->buf + r->len, p, n);
+    r->len += n;
+}
+
+// Returns the bytes written, for the stats overlay to discount.
+static long long rec_flush(Recorder *r) {
+    long long total = 0;
+    size_t off = 0;
+    while (off < r->len) {
+        ssize_t n = write(r->fd, r->buf + off, r->len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            r->ok = false;
+            break;
+        }
+        off += (size_t)n;
+        total += n;
+    }
+    r->len = 0;
+    return total;
+}
+
+// Worst case for rec_encode_frame() with n changes.
+#define REC_FRAME_MAX(n) ((size_t)(n) * 7 + 32)
+
+static bool rec_reserve(Recorder *r, size_t bytes) {
+    if (r->len + bytes <= r->buf_cap) return true;
+    size_t cap = r->buf_cap ? r->buf_cap : REC_FLUSH_AT * 2;
+    while (cap < r->len + bytes) cap *= 2;
+    unsigned char *b = (unsigned char*)heap_realloc(r->buf, cap);
+    if (!b) return false;
+    r->buf = b;
+    r->buf_cap = cap;
+    return true;
+}
+
+// Sizes the recorder for a blank rows x cols screen, with room for a full
+// flush buffer plus the largest frame so recording never allocates later.
+static bool rec_screen(Recorder *r, int rows, int cols) {
+    size_t n = (size_t)rows * cols;
+    if (!rec_reserve(r, REC_FLUSH_AT + REC_FRAME_MAX(2 * n))) return false;
+    if (n > r->cap) {
+        chtype *shadow = (chtype*)heap_realloc(r->shadow, n * sizeof(*shadow));
+        if (shadow) r->shadow = shadow;
+        int *prev = (int*)heap_realloc(r->prev, n * sizeof(*prev));
+        if (prev) r->prev = prev;
+        int *changed = (int*)heap_realloc(r->changed, 2 * n * sizeof(*changed));
+        if (changed) r->changed = changed;
+        if (!shadow || !prev || !changed) return false;
+        r->cap = n;
+    }
+    memset(r->shadow, 0, n * sizeof(*r->shadow));
+    r->nprev = 0;
+    r->rows = rows;
+    r->cols = cols;
+    return true;
+}
+
+// Starts a new screen of rows x cols, blank, in the stream.
+static bool rec_resize(Recorder *r, int rows, int cols) {
+    if (!rec_screen(r, rows, cols) || !rec_reserve(r, 32)) return false;
+    unsigned char tmp[32];
+    size_t k = varint_put(tmp, REC_RESIZE);
+    k += varint_put(tmp + k, (uint64_t)rows);
+    k += varint_put(tmp + k, (uint64_t)cols);
+    rec_put(r, tmp, k);
+    return true;
+}
+
+static size_t rec_header(unsigned char *p, int rows, int cols) {
+    memcpy(p, REC_MAGIC, 5);
+    size_t k = 5;
+    k += varint_put(p + k, (uint64_t)rows);
+    k += varint_put(p + k, (uint64_t)cols);
+    return k;
+}
+
+// Without a path the stream only accumulates in `buf` for the caller to take.
+static bool rec_open(Recorder *r, const char *path, int rows, int cols, double now) {
+    memset(r, 0, sizeof(*r));
+    r->ok = true;
+    r->last_t = now;
+    r->fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if ((path && r->fd < 0) || !rec_reserve(r, 64)) return false;
+    r->len = rec_header(r->buf, rows, cols);
+    return rec_screen(r, rows, cols);
+}
+
+// A frame record for cells idx[0..n) (ascending) taking their values from
+// `cells`.
+static size_t rec_encode_frame(unsigned char *p, uint64_t dt_us, const int *idx, int n, const chtype *cells) {
+    size_t len = varint_put(p, REC_FRAME);
+    len += varint_put(p + len, dt_us);
+    len += varint_put(p + len, (uint64_t)n);
+    int last = -1;
+    for (int k = 0; k < n; ++k) {
+        int i = idx[k];
+        chtype ch = cells[i];
+        len += varint_put(p + len, (uint64_t)(i - last - 1));
+        p[len++] = (unsigned char)(ch & A_CHARTEXT);
+        p[len++] = ch ? attr_to_byte(ch & A_ATTRIBUTES) : 0;
+        last = i;
+    }
+    return len;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Logs the difference between `cv` (composed, not yet presented: cells plus
+// the touched list) and the previous frame. Returns bytes written to disk.
+static long long rec_frame(Recorder *r, const Canvas *cv, double now) {
+    if (!r->ok) return 0;
+    int nchanged = 0;
+    for (int k = 0; k < r->nprev; ++k) {
+        int i = r->prev[k];
+        if (cv->cells[i] == 0 && r->shadow[i] != 0) {
+            r->shadow[i] = 0;
+            r->changed[nchanged++] = i;
+        }
+    }
+    for (int k = 0; k < cv->ntouched; ++k) {
+        int i = cv->touched[k];
+        if (cv->cells[i] != r->shadow[i]) {
+            r->shadow[i] = cv->cells[i];
+            r->changed[nchanged++] = i;
+        }
+    }
+    memcpy(r->prev, cv->touched, cv->ntouched * sizeof(*r->prev));
+    r->nprev = cv->ntouched;
+    qsort(r->changed, nchanged, sizeof(*r->changed), cmp_int);
+
+    if (!rec_reserve(r, REC_FRAME_MAX(nchanged))) { r->ok = false; return 0; }
+    double dt = now - r->last_t;
+    r->last_t = now;
+    r->len += rec_encode_frame(r->buf + r->len, dt > 0 ? (uint64_t)(dt * 1e6 + 0.5) : 0,
+                               r->changed, nchanged, r->shadow);
+    return r->fd >= 0 && r->len >= REC_FLUSH_AT ? rec_flush(r) : 0;
+}
+
+static void rec_close(Recorder *r) {
+    if (r->fd >= 0) {
+        rec_flush(r);
+        close(r->fd);
+    }
+    heap_free(r->shadow); heap_free(r->prev); heap_free(r->changed); heap_free(r->buf);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+// The replayed screen: every cell the stream has set and not blanked yet,
+// kept as a dense list so composing a frame costs O(cells shown).
+typedef struct {
+    int rows, cols;
+    chtype *cells;
+    int *live, nlive;
+    int *slot;          // cell -> index in live, or -1
+} ReplayScreen;
+
+static bool replay_screen_reset(ReplayScreen *rs, int rows, int cols) {
+    size_t n = (size_t)rows * cols;
+    heap_free(rs->cells); heap_free(rs->live); heap_free(rs->slot);
+    rs->rows = rows;
+    rs->cols = cols;
+    rs->nlive = 0;
+    rs->cells = (chtype*)heap_calloc(n, sizeof(*rs->cells));
+    rs->live = (int*)heap_alloc(n * sizeof(*rs->live));
+    rs->slot = (int*)heap_alloc(n * sizeof(*rs->slot));
+    if (!rs->cells || !rs->live || !rs->slot) return false;
+    memset(rs->slot, 0xff, n * sizeof(*rs->slot));
+    return true;
+}
+
+static void replay_screen_set(ReplayScreen *rs, int i, chtype ch) {
+    if (ch && rs->slot[i] < 0) {
+        rs->slot[i] = rs->nlive;
+        rs->live[rs->nlive++] = i;
+    } else if (!ch && rs->slot[i] >= 0) {
+        int last = rs->live[--rs->nlive];
+        rs->live[rs->slot[i]] = last;
+        rs->slot[last] = rs->slot[i];
+        rs->slot[i] = -1;
+    }
+    rs->cells[i] = ch;
+}
+
+static void replay_screen_free(ReplayScreen *rs) {
+    heap_free(rs->cells); heap_free(rs->live); heap_free(rs->slot);
+    memset(rs, 0, sizeof(*rs));
+}
+
+// Plays a --record stream through `backend`. Without a TTY on stdout the
+// backend writes to /dev/null, for benchmarking; a summary goes to stdout.
+// Recordings keep color pairs, so they replay in the --colors they were made with.
+static int run_replay(const char *path, bool fast, int backend, const char *rain_color, const char *light_color,
+                      int colors) {
+    size_t len;
+    unsigned char *data = (unsigned char*)read_file(path, &len);
+    if (!data) {
+        fprintf(stderr, "Error: cannot read %s.\n", path);
+        return 1;
+    }
+    size_t pos = 5;
+    uint64_t rows, cols;
+    if (len < 5 || memcmp(data, REC_MAGIC, 5) != 0 || !varint_get(data, len, &pos, &rows) ||
+        !varint_get(data, len, &pos, &cols) || rows < 1 || cols < 1 || rows > 10000 || cols > 10000) {
+        fprintf(stderr, "Error: %s is not a terminal_weather recording.\n", path);
+        heap_free(data);
+        return 1;
+    }
+
+    bool headless = !isatty(STDOUT_FILENO);
+    Term term;
+    if (!term_open(&term, backend, headless)) {
+        term_close(&term);
+        heap_free(data);
+        fprintf(stderr, "Error: cannot set up the terminal.\n");
+        return 1;
+    }
+    int trows = (int)rows, tcols = (int)cols;
+    if (headless) {
+        if (backend == BACKEND_CURSES) resizeterm(trows, tcols);
+    } else {
+        term_size(&term, &trows, &tcols);
+    }
+    chtype rain_attr, light_attr;
+    term_setup_colors(&term, rain_color, light_color, colors, &rain_attr, &light_attr);
+
+    ReplayScreen rs = {0};
+    Canvas cv = { .rows = trows, .cols = tcols };
+    FrameSched sched;
+    sched_init(&sched, 1.0 / UPDATE_INTERVAL);
+    if (!fast) sched_block_signals(&sched); // --fast never waits to let them in
+    if (!canvas_init_damage(&cv, trows, tcols) || !replay_screen_reset(&rs, (int)rows, (int)cols) ||
+        (backend == BACKEND_ANSI && !ansi_reserve(&term, trows, tcols))) {
+        term_close(&term);
+        fprintf(stderr, "Error: out of memory replaying %s.\n", path);
+        canvas_free(&cv); replay_screen_free(&rs); heap_free(data);
+        return 1;
+    }
+
+    double start = now_sec(), t = start;
+    long long frames = 0;
+    bool bad = false, quit = false;
+    while (!quit && !g_quit && pos < len) {
+        uint64_t tag;
+        if (!varint_get(data, len, &pos, &tag)) { bad = true; break; }
+        if (tag == REC_RESIZE) {
+            if (!varint_get(data, len, &pos, &rows) || !varint_get(data, len, &pos, &cols) ||
+                rows < 1 || cols < 1 || rows > 10000 || cols > 10000) { bad = true; break; }
+            if (!replay_screen_reset(&rs, (int)rows, (int)cols)) { bad = true; break; }
+            if (headless) {
+                // Nothing to fit into: follow the recording's size.
+                if (!canvas_resize(&cv, (int)rows, (int)cols) ||
+                    (backend == BACKEND_ANSI && !ansi_reserve(&term, (int)rows, (int)cols))) { bad = true; break; }
+                if (backend == BACKEND_CURSES) resizeterm((int)rows, (int)cols);
+            }
+            term_clear(&term, &cv);
+            continue;
+        }
+        uint64_t dt_us, n;
+        if (tag != REC_FRAME || !varint_get(data, len, &pos, &dt_us) || !varint_get(data, len, &pos, &n)) {
+            bad = true;
+            break;
+        }
+        size_t ncells = (size_t)rs.rows * rs.cols;
+        int64_t i = -1;
+        for (uint64_t k = 0; k < n && !bad; ++k) {
+            uint64_t gap;
+            if (!varint_get(data, len, &pos, &gap) || pos + 2 > len || (uint64_t)(i + 1) + gap >= ncells) {
+                bad = true;
+                break;
+            }
+            i += (int64_t)gap + 1;
+            unsigned glyph = data[pos++], attr = data[pos++];
+            replay_screen_set(&rs, (int)i, glyph ? glyph | attr_from_byte(attr) : 0);
+        }
+        if (bad) break;
+
+        t += dt_us / 1e6;
+        if (!fast) {
+            sched.deadline = t;
+            int ev;
+            while ((ev = sched_wait(&sched)) != SCHED_FRAME && !g_quit) {
+                if (ev != SCHED_INPUT) continue;
+                int ch;
+                while ((ch = term_getkey(&term)) != ERR)
+                    if (ch == 'q' || ch == 'Q' || ch == 27) quit = true;
+                if (quit) break;
+            }
+        } else if (!headless) {
+            int ch;
+            while ((ch = term_getkey(&term)) != ERR)
+                if (ch == 'q' || ch == 'Q' || ch == 27) quit = true;
+        }
+
+        canvas_clear(&cv);
+        for (int k = 0; k < rs.nlive; ++k) {
+            int c = rs.live[k], y = c / rs.cols, x = c % rs.cols;
+            if (y < cv.rows && x < cv.cols) canvas_put(&cv, y, x, rs.cells[c]);
+        }
+        sched_output(&sched, true);
+        term_present(&term, &cv);
+        sched_output(&sched, false);
+        ++frames;
+    }
+    double elapsed = now_sec() - start;
+    term_close(&term);
+
+    if (bad) fprintf(stderr, "Error: %s is truncated or corrupt after %lld frames.\n", path, frames);
+    printf("replay: %lld frames in %.3fs (%.1f frames/s), backend %s%s\n", frames, elapsed,
+           elapsed > 0 ? frames / elapsed : 0.0, backend == BACKEND_ANSI ? "ansi" : "curses",
+           headless ? " to /dev/null" : "");
+    canvas_free(&cv);
+    replay_screen_free(&rs);
+    heap_free(data);
+    return bad ? 1 : 0;
+}
+
+// --- headless benchmark ---
+enum { PH_BOLT_SPAWN, PH_BOLT_UPDATE, PH_RAIN_SPAWN, PH_RAIN_ADVANCE, PH_DRAW, PH_PRESENT, PH_FRAME, PH_COUNT };
+
+static const char *PHASE_NAMES[PH_COUNT] = {
+    "bolt spawn", "bolt update", "rain spawn", "rain advance", "draw", "present", "frame",
+};
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Runs the frame pipeline `frames` times against an off-screen canvas, one
+// simulation step per frame, and prints per-phase timings in microseconds.
+// With a backend (>= 0) each frame is also presented through it to /dev/null.
+// With several panes each phase covers all of them, as in the main loop.
+static int run_bench(int frames, int rows, int cols, bool thunder, uint64_t seed, int backend,
+                     int threads, double density, int rain_engine, size_t max_memory, int max_bolts, int colors,
+                     int npanes) {
+    Canvas cv = { .rows = rows, .cols = cols };
+    bool canvas_ok = backend >= 0 || npanes > 1 ? canvas_init_damage(&cv, rows, cols)
+                                               : (cv.cells = heap_calloc((size_t)rows * cols, sizeof(chtype))) != NULL;
+    Panes panes;
+    bool sims_ok = panes_init(&panes, npanes, rows, cols, seed, threads, rain_engine);
+    for (int k = 0; sims_ok && k < panes.n; ++k) sims_ok = sim_set_bolt_limit(&panes.v[k].sim, max_bolts);
+    if (!sims_ok || !canvas_ok) {
+        fprintf(stderr, "Error: out of memory for %dx%d benchmark.\n", cols, rows);
+        panes_free(&panes); canvas_free(&cv);
+        return 1;
+    }
+
+    // Same attributes setup_colors() produces on a color terminal.
+    chtype rain_attr = COLOR_PAIR(CP_RAIN_NORMAL);
+    chtype light_attr = COLOR_PAIR(CP_LIGHTNING) | A_BOLD;
+
+    Term term;
+    if (backend >= 0) {
+        if (!term_open(&term, backend, true) || (backend == BACKEND_ANSI && !ansi_reserve(&term, rows, cols))) {
+            fprintf(stderr, "Error: cannot set up the benchmark backend.\n");
+            term_close(&term); panes_free(&panes); canvas_free(&cv);
+            return 1;
+        }
+        if (backend == BACKEND_CURSES) resizeterm(rows, cols);
+        bool shaded = term_setup_colors(&term, "cyan", "yellow", colors, &rain_attr, &light_attr) != COLORS_8;
+        for (int k = 0; k < panes.n; ++k) sim_set_shaded(&panes.v[k].sim, shaded);
+    }
+
+    for (int k = 0; k < panes.n; ++k) {
+        panes.v[k].sim.thunder = thunder;
+        panes.v[k].sim.density = density;
+        panes.v[k].alpha = 0.5;
+    }
+    if (max_memory && !panes_bound(&panes, max_memory)) {
+        fprintf(stderr, "Error: --max-memory %zu is below what a %dx%d benchmark needs before any rain.\n",
+                max_memory, cols, rows);
+        if (backend >= 0) term_close(&term);
+        panes_free(&panes); canvas_free(&cv);
+        return 1;
+    }
+    // The timing samples are the benchmark's own and stay out of the budget.
+    double *samples = heap_alloc((size_t)PH_COUNT * frames * sizeof(*samples));
+    if (!samples) {
+        fprintf(stderr, "Error: out of memory for %dx%d benchmark.\n", cols, rows);
+        if (backend >= 0) term_close(&term);
+        panes_free(&panes); canvas_free(&cv);
+        return 1;
+    }
+
+    // Let the sky fill up so the measured frames see a steady-state drop count.
+    int warmup = (int)(rows / (RAIN_MIN_SPEED * SIM_DT)) + 1;
+    for (int k = 0; k < panes.n; ++k)
+        for (int i = 0; i < warmup; ++i) sim_step(&panes.v[k].sim, SIM_DT);
+
+    // The simulation runs on a virtual clock; now_sec() only times phases.
+    FrameClock clk;
+    frame_clock_init(&clk, true, SIM_DT);
+    clk.now = panes.v[0].sim.t;
+
+    // What the backend wrote, from /proc/self/io: printing the results comes after.
+    int io_fd = backend >= 0 ? open("/proc/self/io", O_RDONLY | O_CLOEXEC) : -1;
+    long long wchar_begin = io_fd >= 0 ? proc_wchar(io_fd) : -1;
+    long allocs_begin = atomic_load(&g_heap_allocs);
+    double t_begin = now_sec();
+    for (int f = 0; f < frames; ++f) {
+        double t[PH_COUNT + 1];
+        t[0] = now_sec();
+        double dt = frame_clock_tick(&clk, t[0]);
+        for (int k = 0; k < panes.n; ++k) {
+            Sim *sim = &panes.v[k].sim;
+            sim->t += dt;
+            FrameTime ft = frame_time_at(sim->t);
+            sim_spawn_bolts(sim, &ft);
+        }
+        t[1] = now_sec();
+        for (int k = 0; k < panes.n; ++k) {
+            FrameTime ft = frame_time_at(panes.v[k].sim.t);
+            sim_update_bolts(&panes.v[k].sim, &ft);
+        }
+        t[2] = now_sec();
+        for (int k = 0; k < panes.n; ++k) sim_spawn_rain(&panes.v[k].sim);
+        t[3] = now_sec();
+        for (int k = 0; k < panes.n; ++k) sim_advance_rain(&panes.v[k].sim, SIM_DT);
+        t[4] = now_sec();
+        panes_render(&panes, &cv, rain_attr, light_attr);
+        t[5] = now_sec();
+        if (backend >= 0) term_present(&term, &cv);
+        t[6] = now_sec();
+
+        for (int p = 0; p < PH_FRAME; ++p) samples[(size_t)p * frames + f] = (t[p + 1] - t[p]) * 1e6;
+        samples[(size_t)PH_FRAME * frames + f] = (t[6] - t[0]) * 1e6;
+    }
+    double elapsed = now_sec() - t_begin;
+    long allocs = atomic_load(&g_heap_allocs) - allocs_begin;
+    long long wchar_end = io_fd >= 0 ? proc_wchar(io_fd) : -1;
+    if (io_fd >= 0) close(io_fd);
+    if (backend >= 0) term_close(&term);
+
+    printf("bench: %dx%d, %d frames (+%d warm-up), seed %llu, thunder %s, rain kernel %s, backend %s, "
+           "threads %d, panes %d, density %g, profile %s\n",
+           cols, rows, frames, warmup, (unsigned long long)seed, thunder ? "on" : "off",
+           rain_engine == RAIN_ENGINE_COLUMNS ? "columns" : rain_kernel_name,
+           backend == BACKEND_CURSES ? "curses" : backend == BACKEND_ANSI ? "ansi" : "none",
+           panes.pool ? panes.pool->n : 1, panes.n, density, WEATHER_PROFILE_NAME);
+    printf("%-14s %10s %10s %10s\n", "phase", "mean(us)", "p50(us)", "p99(us)");
+    for (int p = 0; p < PH_COUNT; ++p) {
+        if (p == PH_PRESENT && backend < 0) continue;
+        double *v = samples + (size_t)p * frames;
+        double sum = 0;
+        for (int f = 0; f < frames; ++f) sum += v[f];
+        qsort(v, frames, sizeof(*v), cmp_double);
+        printf("%-14s %10.2f %10.2f %10.2f\n", PHASE_NAMES[p], sum / frames,
+               v[(frames - 1) * 50 / 100], v[(int)((frames - 1) * 0.99)]);
+    }
+    int bolts = 0;
+    for (int k = 0; k < panes.n; ++k) bolts += panes.v[k].sim.bolts.n;
+    printf("frames/s: %.1f  (live drops: %d, bolts: %d)\n", frames / elapsed, panes_drop_count(&panes), bolts);
+    printf("heap: %ld allocations during the measured frames, %zu bytes live\n",
+           allocs, atomic_load(&g_heap_bytes));
+    if (wchar_begin >= 0 && wchar_end >= 0)
+        printf("output: %.1f bytes/frame\n", (double)(wchar_end - wchar_begin) / frames);
+
+    panes_free(&panes);
+    heap_free(samples);
+    canvas_free(&cv);
+    return 0;
+}
+
+// --- micro-benchmarks ---
+// --microbench times the hot kernels one at a time, each on steady-state
+// input built from the seed, and prints ns per call and items per second
+// (segments, drops or cells). Every kernel runs at 80x24, 200x60 and
+// 1000x300, or only at --size when given. Single-threaded, vector engine.
+#define MICRO_MIN_SEC 0.2 // time each kernel for at least this long
+
+typedef struct {
+    Sim sim;
+    Canvas cv;
+    FrameTime ft;   // fixed: nothing fades while a kernel runs
+    double t;       // bolt update's own clock
+    Bolt bolt;      // one bolt of the sim's pool, outside sim.bolts
+    RainVec snap;   // band 0's steady-state rain, to refill from
+    Rng rng;
+    chtype rain_attr, light_attr;
+} MicroCtx;
+
+// Runs one call of the kernel and returns the number of items it handled.
+typedef long (*MicroFn)(MicroCtx *m);
+
+static void micro_bolt_restart(MicroCtx *m, const FrameTime *ft) {
+    seg_pool_release(&m->sim.seg_pool, m->bolt.slot);
+    bolt_create(&m->bolt, &m->sim.seg_pool, 0, m->sim.cols / 2, m->sim.rows, m->sim.cols, ft,
+                LIGHTNING_GROWTH_DELAY, &m->rng);
+}
+
+static bool rain_copy(RainVec *dst, const RainVec *src) {
+    if (!rain_reserve(dst, src->n)) return false;
+    memcpy(dst->y, src->y, src->n * sizeof(*dst->y));
+    memcpy(dst->speed, src->speed, src->n * sizeof(*dst->speed));
+    memcpy(dst->x, src->x, src->n * sizeof(*dst->x));
+    memcpy(dst->look, src->look, src->n * sizeof(*dst->look));
+    dst->n = src->n;
+    return true;
+}
+
+// Lays out a whole path in a slot of the pool.
+static long micro_bolt_create(MicroCtx *m) {
+    micro_bolt_restart(m, &m->ft);
+    return m->bolt.seg_count;
+}
+
+// One simulation step of revealing and fading; a bolt that has faded starts
+// over, about once every 60 calls. Items are the segments on screen.
+static long micro_bolt_update(MicroCtx *m) {
+    m->t += SIM_DT;
+    FrameTime ft = frame_time_at(m->t);
+    if (!bolt_update(&m->bolt, &ft)) micro_bolt_restart(m, &ft);
+    return m->bolt.revealed - m->bolt.seg_head;
+}
+
+static long micro_bolt_draw(MicroCtx *m) {
+    chtype fade[FADE_STEPS];
+    sim_fade_attrs(&m->sim, m->light_attr, fade);
+    zgrid_reset(&m->sim.zgrid);
+    bolt_draw(&m->bolt, &m->cv, &m->ft, fade, &m->sim.zgrid);
+    return m->bolt.seg_count;
+}
+
+// Advance and compact; refilled once half the drops have left the screen,
+// which amortizes to a small fraction of the advance itself.
+static long micro_rain_advance(MicroCtx *m) {
+    RainVec *rv = &m->sim.bands[0].rain;
+    if (rv->n < m->snap.n / 2) rain_copy(rv, &m->snap);
+    int n = rv->n;
+    rain_advance(rv, (float)SIM_DT, m->sim.rows);
+    return n;
+}
+
+// Spawns one step's worth of drops, storming; emptied before it would grow.
+static long micro_rain_spawn(MicroCtx *m) {
+    RainVec *rv = &m->sim.bands[0].rain;
+    if (rv->n + m->sim.cols > rv->cap) rv->n = 0;
+    int before = rv->n;
+    band_spawn(&m->sim, &m->sim.bands[0], sim_spawn_count(&m->sim, &m->sim.bands[0].rng));
+    return rv->n - before;
+}
+
+static long micro_frame(MicroCtx *m) {
+    sim_render(&m->sim, &m->cv, 0.5, m->rain_attr, m->light_attr);
+    return (long)m->sim.rows * m->sim.cols;
+}
+
+// Calls fn in growing batches until one batch takes MICRO_MIN_SEC.
+static void micro_run(MicroCtx *m, const char *name, const char *unit, MicroFn fn) {
+    long iters = 1, items;
+    double elapsed;
+    for (;;) {
+        items = 0;
+        double t0 = now_sec();
+        for (long i = 0; i < iters; ++i) items += fn(m);
+        elapsed = now_sec() - t0;
+        if (elapsed >= MICRO_MIN_SEC) break;
+        long next = elapsed > 1e-3 ? (long)(iters * MICRO_MIN_SEC * 1.2 / elapsed) + 1 : iters * 8;
+        iters = next > iters * 100 ? iters * 100 : next;
+    }
+    char size[32];
+    snprintf(size, sizeof(size), "%dx%d", m->sim.cols, m->sim.rows);
+    printf("%-14s %10s %12.1f %14.0f %s/s\n", name, size, elapsed * 1e9 / iters, items / elapsed, unit);
+}
+
+static bool micro_size(int rows, int cols, uint64_t seed) {
+    MicroCtx m;
+    memset(&m, 0, sizeof(m));
+    m.rain_attr = COLOR_PAIR(CP_RAIN_NORMAL);
+    m.light_attr = COLOR_PAIR(CP_LIGHTNING) | A_BOLD;
+    m.cv.rows = rows; m.cv.cols = cols;
+    m.cv.cells = heap_calloc((size_t)rows * cols, sizeof(chtype));
+    rng_seed(&m.rng, seed, RNG_STREAM_GROWTH);
+    bool ok = sim_init(&m.sim, rows, cols, seed, 1, RAIN_ENGINE_VECTOR) && m.cv.cells;
+    if (ok) {
+        // Same warm-up as --bench, storming, then one bolt of our own.
+        m.sim.thunder = true;
+        int warmup = (int)(rows / (RAIN_MIN_SPEED * SIM_DT)) + 1;
+        for (int i = 0; i < warmup; ++i) sim_step(&m.sim, SIM_DT);
+        m.ft = frame_time_at(m.sim.t);
+        for (int i = 0; i < m.sim.bolts.n; ++i) seg_pool_release(&m.sim.seg_pool, m.sim.bolts.v[i].slot);
+        m.sim.bolts.n = 0;
+        m.t = m.sim.t;
+        ok = bolt_create(&m.bolt, &m.sim.seg_pool, 0, cols / 2, rows, cols, &m.ft, LIGHTNING_GROWTH_DELAY, &m.rng) &&
+             rain_copy(&m.snap, &m.sim.bands[0].rain);
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: out of memory for %dx%d micro-benchmarks.\n", cols, rows);
+    } else {
+        micro_run(&m, "bolt create", "segments", micro_bolt_create);
+        micro_run(&m, "bolt update", "segments", micro_bolt_update);
+        // Draw and render see a freshly completed bolt.
+        micro_bolt_restart(&m, &m.ft);
+        m.sim.t = m.bolt.segs[m.bolt.seg_count - 1].birth;
+        m.ft = frame_time_at(m.sim.t);
+        bolt_update(&m.bolt, &m.ft);
+        micro_run(&m, "bolt draw", "segments", micro_bolt_draw);
+        micro_run(&m, "rain advance", "drops", micro_rain_advance);
+        micro_run(&m, "rain spawn", "drops", micro_rain_spawn);
+        rain_copy(&m.sim.bands[0].rain, &m.snap);
+        m.sim.bolts.v[m.sim.bolts.n++] = m.bolt;
+        micro_run(&m, "frame render", "cells", micro_frame);
+        m.sim.bolts.n = 0;
+    }
+    rain_free(&m.snap);
+    sim_free(&m.sim);
+    canvas_free(&m.cv);
+    return ok;
+}
+
+static int run_microbench(int rows, int cols, uint64_t seed) {
+    static const int SIZES[][2] = { {24, 80}, {60, 200}, {300, 1000} };
+    printf("microbench: seed %llu, rain kernel %s, profile %s\n",
+           (unsigned long long)seed, rain_kernel_name, WEATHER_PROFILE_NAME);
+    printf("%-14s %10s %12s %14s\n", "kernel", "size", "ns/op", "items/s");
+    if (rows) return micro_size(rows, cols, seed) ? 0 : 1;
+    for (size_t i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); ++i)
+        if (!micro_size(SIZES[i][0], SIZES[i][1], seed)) return 1;
+    return 0;
+}
+
+// --- options ---
+// Command-line flags and --config files go through the same table and parser,
+// so every long option can also be set from a file as "name = value".
+enum { SERVE_ANSI, SERVE_DELTA }; // --serve-format
+
+typedef struct {
+    const char *rain_color, *light_color;
+    int bench_frames;
+    bool microbench;
+    int bench_rows, bench_cols;
+    bool start_thunder;
+    bool damage;
+    bool virtual_clock;
+    double fps;
+    const char *stats_path;
+    int backend; // -1: not given (curses, and no present phase in --bench)
+    int threads;
+    bool render_thread;
+    bool low_power;
+    int rain_engine;
+    size_t max_memory; // bytes, 0: unbounded
+    double max_bps;    // --max-bytes-per-sec, 0: unlimited
+    int max_bolts;
+    bool flash;
+    int colors;        // COLORS_*
+    int panes;
+    double frame_budget_ms;
+    double density;
+    bool have_seed;
+    uint64_t seed;
+    const char *record_path, *replay_path;
+    bool replay_fast;
+    const char *serve_addr;
+    int serve_format;
+    char *config_text; // --config contents; string options may point into it
+} Options;
+
+enum { OPT_BENCH = 256, OPT_SIZE, OPT_SEED, OPT_THUNDER, OPT_DAMAGE, OPT_VIRTUAL_CLOCK, OPT_FPS, OPT_STATS_FILE, OPT_BACKEND,
+       OPT_THREADS, OPT_DENSITY, OPT_RENDER_THREAD, OPT_FRAME_BUDGET, OPT_CONFIG,
+       OPT_RECORD, OPT_REPLAY, OPT_REPLAY_FAST, OPT_SERVE, OPT_SERVE_FORMAT, OPT_LOW_POWER,
+       OPT_RAIN_ENGINE, OPT_MAX_MEMORY, OPT_MICROBENCH, OPT_MAX_BOLTS, OPT_FLASH, OPT_MAX_BPS,
+       OPT_COLORS, OPT_PANES };
+
+static const struct option LONG_OPTS[] = {
+    {"rain-color", required_argument, 0, 'r'},
+    {"lightning-color", required_argument, 0, 'l'},
+    {"bench", required_argument, 0, OPT_BENCH},
+    {"size", required_argument, 0, OPT_SIZE},
+    {"seed", required_argument, 0, OPT_SEED},
+    {"thunder", no_argument, 0, OPT_THUNDER},
+    {"damage", no_argument, 0, OPT_DAMAGE},
+    {"virtual-clock", no_argument, 0, OPT_VIRTUAL_CLOCK},
+    {"fps", required_argument, 0, OPT_FPS},
+    {"stats-file", required_argument, 0, OPT_STATS_FILE},
+    {"backend", required_argument, 0, OPT_BACKEND},
+    {"threads", required_argument, 0, OPT_THREADS},
+    {"density", required_argument, 0, OPT_DENSITY},
+    {"render-thread", no_argument, 0, OPT_RENDER_THREAD},
+    {"frame-budget-ms", required_argument, 0, OPT_FRAME_BUDGET},
+    {"config", required_argument, 0, OPT_CONFIG},
+    {"record", required_argument, 0, OPT_RECORD},
+    {"replay", required_argument, 0, OPT_REPLAY},
+    {"replay-fast", no_argument, 0, OPT_REPLAY_FAST},
+    {"serve", required_argument, 0, OPT_SERVE},
+    {"serve-format", required_argument, 0, OPT_SERVE_FORMAT},
+    {"low-power", no_argument, 0, OPT_LOW_POWER},
+    {"rain-engine", required_argument, 0, OPT_RAIN_ENGINE},
+    {"max-memory", required_argument, 0, OPT_MAX_MEMORY},
+    {"microbench", no_argument, 0, OPT_MICROBENCH},
+    {"max-bolts", required_argument, 0, OPT_MAX_BOLTS},
+    {"flash", no_argument, 0, OPT_FLASH},
+    {"max-bytes-per-sec", required_argument, 0, OPT_MAX_BPS},
+    {"colors", required_argument, 0, OPT_COLORS},
+    {"panes", required_argument, 0, OPT_PANES},
+    {0,0,0,0}
+};
+
+static void options_init(Options *o) {
+    memset(o, 0, sizeof(*o));
+    o->rain_color = "cyan";
+    o->light_color = "yellow";
+    o->fps = 1.0 / UPDATE_INTERVAL;
+    o->backend = -1;
+    o->threads = 1;
+    o->density = 1.0;
+    o->max_bolts = MAX_BOLTS;
+    o->panes = 1;
+}
+
+static void options_free(Options *o) {
+    heap_free(o->config_text);
+    o->config_text = NULL;
+}
+
+// A byte count with an optional K, M or G (binary) suffix; at least 1.
+static bool parse_size(const char *arg, double *out) {
+    char *end;
+    double v = strtod(arg, &end);
+    if (*end == 'k' || *end == 'K') { v *= 1024; ++end; }
+    else if (*end == 'm' || *end == 'M') { v *= 1024 * 1024; ++end; }
+    else if (*end == 'g' || *end == 'G') { v *= 1024.0 * 1024 * 1024; ++end; }
+    if (*end || !(v >= 1)) return false;
+    *out = v;
+    return true;
+}
+
+// Applies option `c` with argument `arg`; reports a bad value and returns false.
+static bool options_apply(Options *o, int c, const char *arg) {
+    if (c == 'r') o->rain_color = arg;
+    else if (c == 'l') o->light_color = arg;
+    else if (c == OPT_BENCH) {
+        o->bench_frames = atoi(arg);
+        if (o->bench_frames <= 0) {
+            fprintf(stderr, "Error: --bench expects a positive frame count.\n");
+            return false;
+        }
+    } else if (c == OPT_SIZE) {
+        if (sscanf(arg, "%dx%d", &o->bench_cols, &o->bench_rows) != 2 || o->bench_cols < 2 || o->bench_rows < 2) {
+            fprintf(stderr, "Error: --size expects COLSxROWS, e.g. 400x120.\n");
+            return false;
+        }
+    } else if (c == OPT_SEED) {
+        o->seed = (uint64_t)strtoull(arg, NULL, 0);
+        o->have_seed = true;
+    } else if (c == OPT_THUNDER) {
+        o->start_thunder = true;
+    } else if (c == OPT_DAMAGE) {
+        o->damage = true;
+    } else if (c == OPT_VIRTUAL_CLOCK) {
+        o->virtual_clock = true;
+    } else if (c == OPT_FPS) {
+        o->fps = strtod(arg, NULL);
+        if (!(o->fps > 0 && o->fps <= 1000)) {
+            fprintf(stderr, "Error: --fps expects a rate between 0 and 1000.\n");
+            return false;
+        }
+    } else if (c == OPT_STATS_FILE) {
+        o->stats_path = arg;
+    } else if (c == OPT_BACKEND) {
+        o->backend = backend_from_name(arg);
+        if (o->backend < 0) {
+            fprintf(stderr, "Error: --backend expects curses or ansi.\n");
+            return false;
+        }
+    } else if (c == OPT_THREADS) {
+        o->threads = atoi(arg);
+        if (o->threads < 1 || o->threads > 256) {
+            fprintf(stderr, "Error: --threads expects a count between 1 and 256.\n");
+            return false;
+        }
+    } else if (c == OPT_DENSITY) {
+        o->density = strtod(arg, NULL);
+        if (!(o->density > 0 && o->density <= 100)) {
+            fprintf(stderr, "Error: --density expects a factor between 0 and 100.\n");
+            return false;
+        }
+    } else if (c == OPT_RENDER_THREAD) {
+        o->render_thread = true;
+    } else if (c == OPT_FRAME_BUDGET) {
+        o->frame_budget_ms = strtod(arg, NULL);
+        if (!(o->frame_budget_ms > 0 && o->frame_budget_ms <= 1000)) {
+            fprintf(stderr, "Error: --frame-budget-ms expects a time between 0 and 1000.\n");
+            return false;
+        }
+    } else if (c == OPT_RECORD) {
+        o->record_path = arg;
+    } else if (c == OPT_REPLAY) {
+        o->replay_path = arg;
+    } else if (c == OPT_REPLAY_FAST) {
+        o->replay_fast = true;
+    } else if (c == OPT_SERVE) {
+        if (strncmp(arg, "unix:", 5) != 0 && strncmp(arg, "tcp:", 4) != 0) {
+            fprintf(stderr, "Error: --serve expects unix:PATH or tcp:[HOST:]PORT.\n");
+            return false;
+        }
+        o->serve_addr = arg;
+    } else if (c == OPT_SERVE_FORMAT) {
+        if (strcasecmp(arg, "ansi") == 0) o->serve_format = SERVE_ANSI;
+        else if (strcasecmp(arg, "delta") == 0) o->serve_format = SERVE_DELTA;
+        else {
+            fprintf(stderr, "Error: --serve-format expects ansi or delta.\n");
+            return false;
+        }
+    } else if (c == OPT_LOW_POWER) {
+        o->low_power = true;
+    } else if (c == OPT_RAIN_ENGINE) {
+        if (strcasecmp(arg, "vector") == 0) o->rain_engine = RAIN_ENGINE_VECTOR;
+        else if (strcasecmp(arg, "columns") == 0) o->rain_engine = RAIN_ENGINE_COLUMNS;
+        else {
+            fprintf(stderr, "Error: --rain-engine expects vector or columns.\n");
+            return false;
+        }
+    } else if (c == OPT_MAX_MEMORY) {
+        double v;
+        if (!parse_size(arg, &v) || v >= (double)SIZE_MAX) {
+            fprintf(stderr, "Error: --max-memory expects a size in bytes, e.g. 4M or 512K.\n");
+            return false;
+        }
+        o->max_memory = (size_t)v;
+    } else if (c == OPT_MICROBENCH) {
+        o->microbench = true;
+    } else if (c == OPT_MAX_BOLTS) {
+        o->max_bolts = atoi(arg);
+        if (o->max_bolts < 1 || o->max_bolts > 256) {
+            fprintf(stderr, "Error: --max-bolts expects a count between 1 and 256.\n");
+            return false;
+        }
+    } else if (c == OPT_FLASH) {
+        o->flash = true;
+    } else if (c == OPT_MAX_BPS) {
+        if (!parse_size(arg, &o->max_bps) || o->max_bps < 100) {
+            fprintf(stderr, "Error: --max-bytes-per-sec expects at least 100, e.g. 11520 or 8K.\n");
+            return false;
+        }
+    } else if (c == OPT_COLORS) {
+        if (strcmp(arg, "8") == 0) o->colors = COLORS_8;
+        else if (strcmp(arg, "256") == 0) o->colors = COLORS_256;
+        else if (strcasecmp(arg, "truecolor") == 0 || strcasecmp(arg, "24bit") == 0) o->colors = COLORS_TRUE;
+        else {
+            fprintf(stderr, "Error: --colors expects 8, 256 or truecolor.\n");
+            return false;
+        }
+    } else if (c == OPT_PANES) {
+        o->panes = atoi(arg);
+        if (o->panes < 1 || o->panes > MAX_PANES) {
+            fprintf(stderr, "Error: --panes expects a count between 1 and %d.\n", MAX_PANES);
+            return false;
+        }
+    }
+    return true;
+}
+
+static char *trim(char *s) {
+    while (*s == ' ' || *s == '\t') ++s;
+    char *e = s + strlen(s);
+    while (e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r')) --e;
+    *e = '\0';
+    return s;
+}
+
+// Reads "name = value" lines, named like the long options without "--".
+// Blank lines and lines starting with '#' are skipped; a flag is set by its
+// bare name or "name = yes" and left alone by "name = no". One file per run.
+static bool options_load(Options *o, const char *path) {
+    if (o->config_text) {
+        fprintf(stderr, "Error: --config may be given only once.\n");
+        return false;
+    }
+    char *text = read_file(path, NULL);
+    if (!text) {
+        fprintf(stderr, "Error: cannot read config file %s.\n", path);
+        return false;
+    }
+    o->config_text = text;
+
+    int lineno = 0;
+    for (char *line = text, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        ++lineno;
+        char *key = trim(line);
+        if (*key == '\0' || *key == '#') continue;
+        char *val = strchr(key, '=');
+        if (val) {
+            *val++ = '\0';
+            val = trim(val);
+            key = trim(key);
+        } else {
+            val = key + strlen(key);
+        }
+
+        const struct option *opt = LONG_OPTS;
+        while (opt->name && strcmp(opt->name, key) != 0) ++opt;
+        if (!opt->name || opt->val == OPT_CONFIG) {
+            fprintf(stderr, "Error: %s:%d: unknown option '%s'.\n", path, lineno, key);
+            return false;
+        }
+        if (opt->has_arg == no_argument) {
+            if (strcasecmp(val, "no") == 0 || strcasecmp(val, "false") == 0 ||
+                strcasecmp(val, "off") == 0 || strcmp(val, "0") == 0)
+                continue;
+            if (*val && strcasecmp(val, "yes") && strcasecmp(val, "true") && strcasecmp(val, "on") && strcmp(val, "1")) {
+                fprintf(stderr, "Error: %s:%d: '%s' is a flag; use yes or no.\n", path, lineno, key);
+                return false;
+            }
+        } else if (*val == '\0') {
+            fprintf(stderr, "Error: %s:%d: '%s' needs a value.\n", path, lineno, key);
+            return false;
+        }
+        if (!options_apply(o, opt->val, val)) {
+            fprintf(stderr, "  (in %s:%d)\n", path, lineno);
+            return false;
+        }
+    }
+    return true;
+}
+
+// --- frame server ---
+// --serve ADDR simulates once and streams every frame to all connected
+// clients of a Unix (unix:PATH) or TCP (tcp:[HOST:]PORT) socket, encoded as
+// ANSI for a terminal to cat, or in the --record stream format. Frames are
+// encoded once and shared. Sockets are non-blocking: a client that has not
+// taken all of the previous frame skips frames until it has, then gets a
+// keyframe (the whole screen) so it is in step again, as do new clients.
+// A slow client therefore holds at most one frame of memory.
+#define SERVE_MAX_CLIENTS 64
+
+typedef struct {
+    int fd;
+    unsigned char *pending; // not yet accepted by the socket
+    size_t off, len, cap;
+    bool need_key;
+    bool fresh;             // delta: has not had the stream header yet
+} ServeClient;
+
+typedef struct {
+    int listen_fd;
+    int format;
+    ServeClient clients[SERVE_MAX_CLIENTS];
+    int nclients;
+    Term enc;               // ANSI encoder (output buffer only, no fd)
+    Recorder rec;           // delta encoder (memory only)
+    unsigned char *key;     // keyframe of the current frame, built on demand
+    size_t key_len, key_cap;
+    int *key_idx;
+    long long frames, skipped;
+} FrameServer;
+
+static void serve_nonblock(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static int serve_listen(const char *addr) {
+    int fd = -1;
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if (strlen(addr + 5) >= sizeof(sun.sun_path)) { errno = ENAMETOOLONG; return -1; }
+        strcpy(sun.sun_path, addr + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        serve_nonblock(fd);
+        unlink(sun.sun_path);
+        if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0 || listen(fd, 16) != 0) { close(fd); return -1; }
+        return fd;
+    }
+    if (strncmp(addr, "tcp:", 4) != 0) { errno = EINVAL; return -1; }
+    char host[256];
+    const char *port = strrchr(addr + 4, ':');
+    if (port) {
+        size_t n = (size_t)(port - (addr + 4));
+        if (n >= sizeof(host)) { errno = ENAMETOOLONG; return -1; }
+        memcpy(host, addr + 4, n);
+        host[n] = '\0';
+        ++port;
+    } else {
+        host[0] = '\0';
+        port = addr + 4;
+    }
+    struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0) { errno = EINVAL; return -1; }
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        serve_nonblock(fd);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void serve_drop(FrameServer *fs, int i) {
+    close(fs->clients[i].fd);
+    heap_free(fs->clients[i].pending);
+    fs->clients[i] = fs->clients[--fs->nclients];
+}
+
+static void serve_accept(FrameServer *fs) {
+    for (;;) {
+        int fd = accept(fs->listen_fd, NULL, NULL);
+        if (fd < 0) return;
+        serve_nonblock(fd);
+        if (fs->nclients == SERVE_MAX_CLIENTS) { close(fd); continue; }
+        fs->clients[fs->nclients++] = (ServeClient){ .fd = fd, .need_key = true, .fresh = true };
+    }
+}
+
+// Writes what the socket takes now; false when the client is gone.
+static bool serve_write(ServeClient *c, const unsigned char *p, size_t n, size_t *done) {
+    *done = 0;
+    while (*done < n) {
+        ssize_t w = send(c->fd, p + *done, n - *done, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        *done += (size_t)w;
+    }
+    return true;
+}
+
+// The rest of a frame the client could not take yet.
+static bool serve_keep(ServeClient *c, const unsigned char *p, size_t n) {
+    if (n > c->cap) {
+        unsigned char *b = (unsigned char*)heap_realloc(c->pending, n);
+        if (!b) return false;
+        c->pending = b;
+        c->cap = n;
+    }
+    memcpy(c->pending, p, n);
+    c->off = 0;
+    c->len = n;
+    return true;
+}
+
+static bool serve_key_reserve(FrameServer *fs, size_t n) {
+    if (n <= fs->key_cap) return true;
+    unsigned char *b = (unsigned char*)heap_realloc(fs->key, n);
+    if (!b) return false;
+    fs->key = b;
+    fs->key_cap = n;
+    return true;
+}
+
+// Keyframe for `cv` in the server's format. A delta keyframe starts a stream
+// (fresh) or a blank screen, then sets every drawn cell.
+static bool serve_build_key(FrameServer *fs, const Canvas *cv, bool fresh) {
+    if (fs->format == SERVE_ANSI) {
+        // enc.out still holds this frame's diff, so encode into the key
+        // buffer instead.
+        if (!serve_key_reserve(fs, fs->enc.out_cap)) return false;
+        char *out = fs->enc.out;
+        size_t out_len = fs->enc.out_len;
+        fs->enc.out = (char*)fs->key;
+        fs->enc.out_len = 0;
+        ansi_encode_key(&fs->enc, cv);
+        fs->key_len = fs->enc.out_len;
+        fs->enc.out = out;
+        fs->enc.out_len = out_len;
+        return true;
+    }
+    if (!serve_key_reserve(fs, REC_FRAME_MAX(cv->ntouched) + 32)) return false;
+    memcpy(fs->key_idx, cv->touched, cv->ntouched * sizeof(*fs->key_idx));
+    qsort(fs->key_idx, cv->ntouched, sizeof(*fs->key_idx), cmp_int);
+    size_t k;
+    if (fresh) {
+        k = rec_header(fs->key, cv->rows, cv->cols);
+    } else {
+        k = varint_put(fs->key, REC_RESIZE);
+        k += varint_put(fs->key + k, (uint64_t)cv->rows);
+        k += varint_put(fs->key + k, (uint64_t)cv->cols);
+    }
+    fs->key_len = k + rec_encode_frame(fs->key + k, 0, fs->key_idx, cv->ntouched, cv->cells);
+    return true;
+}
+
+// Sends the composed frame `cv` to every client, then ends the frame.
+static void serve_frame(FrameServer *fs, Canvas *cv, double now) {
+    serve_accept(fs);
+
+    const unsigned char *diff;
+    size_t diff_len;
+    if (fs->format == SERVE_ANSI) {
+        // Every frame starts from an unknown cursor and SGR state, so it
+        // applies the same after a keyframe as after the previous frame.
+        fs->enc.cur_y = -1;
+        fs->enc.cur_attr = ANSI_ATTR_UNKNOWN;
+        fs->enc.out_len = 0;
+        ansi_encode_diff(&fs->enc, cv);
+        diff = (const unsigned char*)fs->enc.out;
+        diff_len = fs->enc.out_len;
+    } else {
+        fs->rec.len = 0;
+        rec_frame(&fs->rec, cv, now);
+        diff = fs->rec.buf;
+        diff_len = fs->rec.len;
+    }
+
+    int built = -1; // -1: no keyframe yet, else its `fresh`
+    for (int i = 0; i < fs->nclients; ++i) {
+        ServeClient *c = &fs->clients[i];
+        size_t done;
+        bool ok = true;
+        if (c->off < c->len) {
+            ok = serve_write(c, c->pending + c->off, c->len - c->off, &done);
+            c->off += done;
+        }
+        if (ok && c->off < c->len) {
+            c->need_key = true;
+            ++fs->skipped;
+            continue;
+        }
+        const unsigned char *p = diff;
+        size_t n = diff_len;
+        if (ok && c->need_key) {
+            bool fresh = fs->format == SERVE_DELTA && c->fresh;
+            if (built != (int)fresh) {
+                ok = serve_build_key(fs, cv, fresh);
+                built = (int)fresh;
+            }
+            p = fs->key;
+            n = fs->key_len;
+            c->need_key = false;
+            c->fresh = false;
+        }
+        if (ok) ok = serve_write(c, p, n, &done);
+        if (ok && done < n) ok = serve_keep(c, p + done, n - done);
+        if (!ok) serve_drop(fs, i--);
+    }
+    canvas_end_frame(cv);
+    ++fs->frames;
+}
+
+static void serve_close(FrameServer *fs, const char *addr) {
+    while (fs->nclients) serve_drop(fs, fs->nclients - 1);
+    if (fs->listen_fd >= 0) close(fs->listen_fd);
+    if (strncmp(addr, "unix:", 5) == 0) unlink(addr + 5);
+    heap_free(fs->enc.out); heap_free(fs->enc.row_lo); heap_free(fs->enc.row_hi);
+    heap_free(fs->enc.pend); heap_free(fs->enc.order);
+    rec_close(&fs->rec);
+    heap_free(fs->key);
+    heap_free(fs->key_idx);
+}
+
+// Runs the simulation headless at --size (80x24 by default) and serves it
+// until SIGINT/SIGTERM.
+static int run_server(const Options *o) {
+    int rows = o->bench_rows ? o->bench_rows : 24, cols = o->bench_rows ? o->bench_cols : 80;
+    FrameServer fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.format = o->serve_format;
+    fs.listen_fd = serve_listen(o->serve_addr);
+    if (fs.listen_fd < 0) {
+        fprintf(stderr, "Error: cannot listen on %s: %s.\n", o->serve_addr, strerror(errno));
+        return 1;
+    }
+    set_signal(SIGPIPE, SIG_IGN);
+    set_signal(SIGINT, on_quit);
+    set_signal(SIGTERM, on_quit);
+    set_signal(SIGHUP, on_quit);
+
+    fs.enc.kind = BACKEND_ANSI;
+    fs.enc.out_fd = -1;
+    chtype rain_attr, light_attr;
+    int colors = term_setup_colors(&fs.enc, o->rain_color, o->light_color, o->colors, &rain_attr, &light_attr);
+    fs.key_idx = (int*)heap_alloc((size_t)rows * cols * sizeof(*fs.key_idx));
+
+    Sim sim;
+    Canvas cv = { .rows = rows, .cols = cols };
+    if (!sim_init(&sim, rows, cols, o->seed, o->threads, o->rain_engine) || !sim_set_bolt_limit(&sim, o->max_bolts) ||
+        !canvas_init_damage(&cv, rows, cols) ||
+        !ansi_reserve(&fs.enc, rows, cols) || !rec_open(&fs.rec, NULL, rows, cols, now_sec()) || !fs.key_idx) {
+        fprintf(stderr, "Error: out of memory for a %dx%d server.\n", cols, rows);
+        sim_free(&sim); canvas_free(&cv); serve_close(&fs, o->serve_addr);
+        return 1;
+    }
+    sim_set_shaded(&sim, colors != COLORS_8);
+    sim.thunder = o->start_thunder;
+    sim.density = o->density;
+
+    LodCtl lod = { .budget_ms = o->frame_budget_ms };
+    FrameSched sched;
+    sched_init(&sched, o->fps);
+    sched_block_signals(&sched);
+    sched.poll_stdin = false;
+    FrameClock clk;
+    frame_clock_init(&clk, o->virtual_clock, sched.base_interval);
+    double acc = 0.0;
+    uint64_t last_hash = 0;
+    fprintf(stderr, "serve: %dx%d %s frames on %s\n", cols, rows, o->serve_format == SERVE_ANSI ? "ansi" : "delta",
+            o->serve_addr);
+
+    while (!g_quit) {
+        if (sched_wait(&sched) != SCHED_FRAME) continue;
+        double now = now_sec();
+        sched_begin_frame(&sched, now);
+        double alpha = sim_advance(&sim, frame_clock_tick(&clk, now), &acc);
+        sim_render(&sim, &cv, alpha, rain_attr, light_attr);
+        uint64_t hash = cv.hash;
+        serve_frame(&fs, &cv, now);
+        // Idle frames back off as on a tty; new clients wait at most that long.
+        sched_end_frame(&sched, hash != last_hash, 0);
+        last_hash = hash;
+        sim.lod = lod_update(&lod, sim.lod, (now_sec() - now) * 1e3);
+    }
+
+    fprintf(stderr, "serve: %lld frames, %lld skipped by slow clients\n", fs.frames, fs.skipped);
+    sim_free(&sim);
+    canvas_free(&cv);
+    serve_close(&fs, o->serve_addr);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // Parse options; --config files are applied where they appear.
+    Options o;
+    options_init(&o);
+    int c;
+    while ((c = getopt_long(argc, argv, "r:l:", LONG_OPTS, NULL)) != -1) {
+        bool ok = c == OPT_CONFIG ? options_load(&o, optarg) : options_apply(&o, c, optarg);
+        if (!ok) { options_free(&o); return 1; }
+    }
+
+    if (!o.have_seed) o.seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    rain_kernel_init();
+
+    if (o.microbench) {
+        int rc = run_microbench(o.bench_rows, o.bench_cols, o.seed);
+        options_free(&o);
+        return rc;
+    }
+    if (o.bench_frames > 0) {
+        if (o.bench_rows == 0) { o.bench_cols = 80; o.bench_rows = 24; }
+        int rc = run_bench(o.bench_frames, o.bench_rows, o.bench_cols, o.start_thunder, o.seed, o.backend,
+                           o.threads, o.density, o.rain_engine, o.max_memory, o.max_bolts, o.colors, o.panes);
+        options_free(&o);
+        return rc;
+    }
+    if (o.serve_addr) {
+        int rc = run_server(&o);
+        options_free(&o);
+        return rc;
+    }
+    if (o.replay_path) {
+        int rc = run_replay(o.replay_path, o.replay_fast, o.backend < 0 ? BACKEND_CURSES : o.backend,
+                            o.rain_color, o.light_color, o.colors);
+        options_free(&o);
+        return rc;
+    }
+
+    if (!isatty(STDOUT_FILENO) || getenv("TERM") == NULL || strcmp(getenv("TERM"), "dumb") == 0) {
+        fprintf(stderr, "Error: This program requires a real TTY.\n");
+        options_free(&o);
+        return 1;
+    }
+
+    FrameStats stats;
+    if (!stats_init(&stats, o.stats_path)) {
+        fprintf(stderr, "Error: cannot open stats file %s.\n", o.stats_path);
+        stats_free(&stats);
+        options_free(&o);
+        return 1;
+    }
+    if (o.max_bps > 0 && stats.io_fd < 0) {
+        fprintf(stderr, "Error: --max-bytes-per-sec needs /proc/self/io to count output.\n");
+        stats_free(&stats);
+        options_free(&o);
+        return 1;
+    }
+
+    // Installed before initscr(): curses leaves a handler it finds alone, but
+    // would otherwise ignore SIGTSTP during every refresh, and with it a ^Z
+    // that is pending while the signal is blocked.
+    set_signal(SIGWINCH, on_winch);
+    set_signal(SIGTSTP, on_suspend);
+    set_signal(SIGUSR1, on_idle);
+    set_signal(SIGUSR2, on_idle);
+
+    if (o.backend < 0) o.backend = BACKEND_CURSES;
+    Term term;
+    if (!term_open(&term, o.backend, false)) {
+        term_close(&term);
+        stats_free(&stats);
+        fprintf(stderr, "Error: cannot set up the terminal.\n");
+        options_free(&o);
+        return 1;
+    }
+
+    int rows, cols;
+    term_size(&term, &rows, &cols);
+
+    chtype rain_attr, light_attr;
+    int colors = term_setup_colors(&term, o.rain_color, o.light_color, o.colors, &rain_attr, &light_attr);
+
+    // The ANSI backend and the presenter always work from a damage-tracked
+    // canvas, and worker threads need a cell buffer instead of stdscr.
+    // Recording diffs the composed frame, and the output budget presents rows
+    // selectively, so they need the same.
+    if (o.backend == BACKEND_ANSI || o.threads > 1 || o.render_thread || o.record_path || o.max_bps > 0)
+        o.damage = true;
+    term.raw_input = o.render_thread || o.low_power;
+    if (o.low_power) term_focus_events(&term, true);
+    if (o.render_thread) {
+        // ncurses' own handlers would tear the screen down under the presenter.
+        set_signal(SIGINT, on_quit);
+        set_signal(SIGTERM, on_quit);
+        set_signal(SIGHUP, on_quit);
+    }
+
+    Panes panes;
+    Canvas screen = { .rows = rows, .cols = cols };
+    bool sims_ok = panes_init(&panes, o.panes, rows, cols, o.seed, o.threads, o.rain_engine);
+    for (int k = 0; sims_ok && k < panes.n; ++k) sims_ok = sim_set_bolt_limit(&panes.v[k].sim, o.max_bolts);
+    if (!sims_ok || (o.damage && !canvas_init_damage(&screen, rows, cols)) ||
+        (o.backend == BACKEND_ANSI && !ansi_reserve(&term, rows, cols))) {
+        term_close(&term);
+        fprintf(stderr, "Error: out of memory for a %dx%d screen.\n", cols, rows);
+        panes_free(&panes); canvas_free(&screen); stats_free(&stats);
+        options_free(&o);
+        return 1;
+    }
+    for (int k = 0; k < panes.n; ++k) {
+        Sim *sim = &panes.v[k].sim;
+        sim_set_shaded(sim, colors != COLORS_8);
+        sim->thunder = o.start_thunder;
+        sim->density = o.density;
+    }
+
+    Presenter pres = {0};
+    if (o.render_thread && (!presenter_init(&pres, rows, cols) || !presenter_start(&pres, &term, &screen))) {
+        presenter_free(&pres);
+        term_close(&term);
+        fprintf(stderr, "Error: cannot start the render thread.\n");
+        panes_free(&panes); canvas_free(&screen); stats_free(&stats);
+        options_free(&o);
+        return 1;
+    }
+
+    Recorder rec = { .fd = -1 };
+    if (o.record_path && !rec_open(&rec, o.record_path, rows, cols, now_sec())) {
+        presenter_stop(&pres); presenter_free(&pres);
+        term_close(&term);
+        fprintf(stderr, "Error: cannot write recording %s.\n", o.record_path);
+        rec_close(&rec); panes_free(&panes); canvas_free(&screen); stats_free(&stats);
+        options_free(&o);
+        return 1;
+    }
+
+    if (o.max_memory && !panes_bound(&panes, o.max_memory)) {
+        size_t other = atomic_load(&g_heap_bytes) - panes_rain_bytes(&panes);
+        presenter_stop(&pres); presenter_free(&pres);
+        term_close(&term);
+        fprintf(stderr, "Error: --max-memory %zu is below the %zu bytes a %dx%d screen needs before any rain.\n",
+                o.max_memory, other, cols, rows);
+        rec_close(&rec); panes_free(&panes); canvas_free(&screen); stats_free(&stats);
+        options_free(&o);
+        return 1;
+    }
+
+    LodCtl lod = { .budget_ms = o.frame_budget_ms };
+    OutLimit outlim;
+    outlim_init(&outlim, o.max_bps, now_sec());
+    FrameSched sched;
+    sched_init(&sched, o.fps);
+    sched_block_signals(&sched);
+    FrameClock clk;
+    frame_clock_init(&clk, o.virtual_clock, sched.base_interval);
+    uint64_t last_hash = 0;
+    bool quit = false;
+    bool show_stats = false;
+    bool unfocused = false, idle = false; // either one pauses the animation
+
+    while (!quit && !g_quit) {
+        int ev = sched_wait(&sched);
+
+        // A burst of SIGWINCH is handled once, at the start of the next frame.
+        if (ev == SCHED_SIGNAL && g_resized) sched_wake(&sched);
+        if (g_suspend) {
+            g_suspend = 0;
+            presenter_stop(&pres);
+            term_suspend(&term);
+            // Pending while blocked; unblocking delivers it: stopped here until SIGCONT.
+            sigset_t tstp;
+            sigemptyset(&tstp);
+            sigaddset(&tstp, SIGTSTP);
+            set_signal(SIGTSTP, SIG_DFL);
+            raise(SIGTSTP);
+            pthread_sigmask(SIG_UNBLOCK, &tstp, NULL);
+            pthread_sigmask(SIG_BLOCK, &tstp, NULL);
+            set_signal(SIGTSTP, on_suspend);
+            term_resume(&term);
+            term_clear(&term, &screen);
+            if (o.render_thread && !presenter_start(&pres, &term, &screen)) break;
+            sched_wake(&sched);
+        }
+        if (g_idle) {
+            idle = g_idle == 1;
+            g_idle = 0;
+            sched_pause(&sched, unfocused || idle);
+        }
+
+        if (ev == SCHED_INPUT) {
+            int ch;
+            while ((ch = term_getkey(&term)) != ERR) {
+                if (ch == 'q' || ch == 'Q' || ch == 27) { quit = true; break; }
+                if (ch == 't' || ch == 'T') {
+                    for (int k = 0; k < panes.n; ++k) panes.v[k].sim.thunder = !panes.v[k].sim.thunder;
+                    if (pres.running) atomic_store(&pres.clear, true);
+                    else term_clear(&term, &screen);
+                    sched_wake(&sched);
+                }
+                if (ch == 'f' || ch == 'F') {
+                    show_stats = !show_stats;
+                    sched_wake(&sched);
+                }
+                if (o.low_power && (ch == TERM_FOCUS_IN || ch == TERM_FOCUS_OUT)) {
+                    unfocused = ch == TERM_FOCUS_OUT;
+                    sched_pause(&sched, unfocused || idle);
+                }
+            }
+        }
+        if (ev != SCHED_FRAME) continue;
+
+        if (g_resized) {
+            g_resized = 0;
+            presenter_stop(&pres);
+            term_resized(&term, &rows, &cols);
+            if (!panes_resize(&panes, rows, cols)) break;
+            if (screen.cells && !canvas_resize(&screen, rows, cols)) break;
+            if (o.backend == BACKEND_ANSI && !ansi_reserve(&term, rows, cols)) break;
+            screen.rows = rows; screen.cols = cols;
+            if (o.render_thread &&
+                (!presenter_resize(&pres, rows, cols) || !presenter_start(&pres, &term, &screen))) break;
+            if (rec.fd >= 0 && !rec_resize(&rec, rows, cols)) break;
+            if (o.max_memory && !panes_bound(&panes, o.max_memory)) break;
+        }
+
+        double now = now_sec();
+        sched_begin_frame(&sched, now);
+
+        panes_advance(&panes, frame_clock_tick(&clk, now));
+        double t_sim = now_sec();
+        Canvas *frame = pres.running ? presenter_back(&pres) : &screen;
+        panes_render(&panes, frame, rain_attr, light_attr);
+        if (show_stats) stats_draw(&stats, frame);
+        if (rec.fd >= 0) stats.own_bytes += rec_frame(&rec, frame, now);
+        sched_output(&sched, true);
+        int sky = 0;
+        if (o.flash)
+            for (int k = 0; k < panes.n; ++k) sky |= sim_sky(&panes.v[k].sim);
+        if (pres.running) {
+            if (o.flash) atomic_store(&pres.sky, sky);
+            presenter_publish(&pres);
+        } else {
+            term_present(&term, &screen);
+            if (o.flash) term_sky(&term, sky);
+        }
+        sched_output(&sched, false);
+        double t_render = now_sec();
+
+        if (show_stats || stats.stats_fd >= 0 || outlim.rate > 0)
+            stats_frame(&stats, &panes, now, (t_sim - now) * 1e3, (t_render - t_sim) * 1e3);
+        double lod_level = lod_update(&lod, panes.v[0].sim.lod, (t_render - now) * 1e3);
+        for (int k = 0; k < panes.n; ++k) panes.v[k].sim.lod = lod_level;
+
+        if (o.low_power) {
+            double idle_dt = sim_idle_interval(&panes.v[0].sim);
+            for (int k = 1; k < panes.n; ++k) {
+                double dt = sim_idle_interval(&panes.v[k].sim);
+                if (dt < idle_dt) idle_dt = dt;
+            }
+            sched.min_interval = idle_dt;
+        }
+        sched_end_frame(&sched, frame->hash != last_hash, tty_pending_output());
+        last_hash = frame->hash;
+        if (outlim.rate > 0) {
+            double next = outlim_charge(&outlim, stats.bytes, t_render);
+            if (next > sched.deadline) sched.deadline = next;
+            for (int k = 0; k < panes.n; ++k) {
+                Sim *sim = &panes.v[k].sim;
+                sim->hide_below = outlim.level >= 1 ? sim_thin_speed(sim) : 0.0f;
+            }
+            if (pres.running) atomic_store(&pres.row_step, outlim_row_step(&outlim));
+            else canvas_set_row_step(&screen, outlim_row_step(&outlim));
+        }
     }
 
-    for (int i = 0; i < bolts.n; ++i) free(bolts.v[i].segs);
-    free(bolts.v); free(rain.v);
+    presenter_stop(&pres);
+    presenter_free(&pres);
+    rec_close(&rec);
+    panes_free(&panes);
+    canvas_free(&screen);
+    stats_free(&stats);
 
-    endwin();
+    term_close(&term);
+    options_free(&o);
     return 0;
 }
@@ -0,0 +1,72 @@
+// weather_profiles.h
+// Build-time tuning presets for terminal_weather.c. Pick one with
+//     gcc -DWEATHER_PROFILE=lowpower ...
+// (default, lowpower or dense; default when unset). Everything here ends up
+// as a compile-time constant in the simulation loops, so a profile costs
+// nothing at run time. Settings that are not on a hot path (colors, frame
+// rate, threads, ...) can instead be changed per run with --config FILE.
+#ifndef WEATHER_PROFILES_H
+#define WEATHER_PROFILES_H
+
+#define WEATHER_PROFILE_ID_default  1
+#define WEATHER_PROFILE_ID_lowpower 2
+#define WEATHER_PROFILE_ID_dense    3
+
+#ifndef WEATHER_PROFILE
+#define WEATHER_PROFILE default
+#endif
+
+// Two levels so WEATHER_PROFILE is expanded before pasting or stringizing.
+#define WEATHER_PROFILE_PASTE(a, b) a##b
+#define WEATHER_PROFILE_ID(p)       WEATHER_PROFILE_PASTE(WEATHER_PROFILE_ID_, p)
+#define WEATHER_PROFILE_STR2(p)     #p
+#define WEATHER_PROFILE_STR(p)      WEATHER_PROFILE_STR2(p)
+#define WEATHER_PROFILE_NAME        WEATHER_PROFILE_STR(WEATHER_PROFILE)
+
+#if WEATHER_PROFILE_ID(WEATHER_PROFILE) == WEATHER_PROFILE_ID_default
+// Desktop terminal at about 66 FPS; the look the program always had.
+#define WP_FRAME_INTERVAL        0.015 // default seconds between rendered frames
+#define WP_RAIN_CHANCE           0.3   // chance per step that any drops spawn
+#define WP_RAIN_CHANCE_STORM     0.5
+#define WP_RAIN_COLS_PER_DROP    15    // up to cols/N drops per spawn
+#define WP_RAIN_COLS_PER_DROP_STORM 8
+#define WP_RAIN_GLYPHS           "|.`"
+#define WP_MAX_BOLTS             3
+#define WP_LIGHTNING_CHANCE      0.005 // per step, while storming
+#define WP_LIGHTNING_BRANCH_CHANCE 0.3
+#define WP_FORK_CHANCE           0.15
+#define WP_SEGMENT_LIFESPAN      0.8   // seconds for a segment to fade out
+
+#elif WEATHER_PROFILE_ID(WEATHER_PROFILE) == WEATHER_PROFILE_ID_lowpower
+// Embedded panels: a quarter of the frames, sparse rain, one short bolt.
+#define WP_FRAME_INTERVAL        0.066
+#define WP_RAIN_CHANCE           0.2
+#define WP_RAIN_CHANCE_STORM     0.35
+#define WP_RAIN_COLS_PER_DROP    30
+#define WP_RAIN_COLS_PER_DROP_STORM 16
+#define WP_RAIN_GLYPHS           "|"
+#define WP_MAX_BOLTS             1
+#define WP_LIGHTNING_CHANCE      0.003
+#define WP_LIGHTNING_BRANCH_CHANCE 0.15
+#define WP_FORK_CHANCE           0.05
+#define WP_SEGMENT_LIFESPAN      0.5
+
+#elif WEATHER_PROFILE_ID(WEATHER_PROFILE) == WEATHER_PROFILE_ID_dense
+// Fast desktops: twice the rain, more and bushier bolts that linger.
+#define WP_FRAME_INTERVAL        0.015
+#define WP_RAIN_CHANCE           0.6
+#define WP_RAIN_CHANCE_STORM     0.8
+#define WP_RAIN_COLS_PER_DROP    8
+#define WP_RAIN_COLS_PER_DROP_STORM 4
+#define WP_RAIN_GLYPHS           "|.`'"
+#define WP_MAX_BOLTS             6
+#define WP_LIGHTNING_CHANCE      0.01
+#define WP_LIGHTNING_BRANCH_CHANCE 0.4
+#define WP_FORK_CHANCE           0.25
+#define WP_SEGMENT_LIFESPAN      1.0
+
+#else
+#error "WEATHER_PROFILE must be default, lowpower or dense"
+#endif
+
+#endif // WEATHER_PROFILES_H